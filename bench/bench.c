@@ -0,0 +1,411 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+/*
+ * End-to-end benchmark driver. Starts csxlock on the display in $DISPLAY
+ * (an Xvfb started by bench/run.sh), types into it with XTest and watches
+ * the screen with XGetImage to measure:
+ *
+ *  - time from exec to the keyboard grab and to the first frame,
+ *  - keypress to pixel change latency for single keys, typing bursts and
+ *    backspace storms,
+ *  - layout switch to pixel change latency,
+ *  - failed and successful authentication round trips.
+ *
+ * Results are printed to stdout as JSON with percentiles.
+ *
+ * usage: bench CSXLOCK [CSXLOCK OPTIONS...]
+ * environment: BENCH_ITERATIONS (default 10), BENCH_PASSWORD (default
+ * "benchpass", must match bench/pam.d/csxlock)
+ *
+ */
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>    // XDestroyImage()
+#include <X11/XKBlib.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+
+/* keys typed per single-key, burst and backspace run */
+#define KEYS        16
+/* failed attempts per iteration */
+#define FAILURES    4
+/* layout switches per iteration */
+#define SWITCHES    4
+/* give up waiting for the screen after this long, us */
+#define TIMEOUT     3000000
+/* the screen counts as settled after this long without change, us */
+#define SETTLE      100000
+
+enum {
+    M_GRAB,         /* exec to keyboard grab */
+    M_FIRST_FRAME,  /* exec to first frame */
+    M_KEY,          /* single keypress to pixel change */
+    M_BURST,        /* KEYS keypresses to final mask */
+    M_BACKSPACE,    /* KEYS backspaces to empty mask */
+    M_LAYOUT,       /* layout switch to pixel change */
+    M_AUTH_FAIL,    /* return to 'authentication failed' */
+    M_AUTH_OK,      /* return to process exit */
+    M_COUNT
+};
+
+static const char *metric_names[M_COUNT] = {
+    [M_GRAB]        = "time_to_grab_us",
+    [M_FIRST_FRAME] = "time_to_first_frame_us",
+    [M_KEY]         = "keypress_to_pixel_us",
+    [M_BURST]       = "typing_burst_us",
+    [M_BACKSPACE]   = "backspace_storm_us",
+    [M_LAYOUT]      = "layout_switch_us",
+    [M_AUTH_FAIL]   = "auth_failed_roundtrip_us",
+    [M_AUTH_OK]     = "auth_success_roundtrip_us",
+};
+
+typedef struct Metric {
+    uint64_t *samples;
+    size_t n, size;
+    unsigned int timeouts;
+} Metric;
+
+/* a screen area whose contents are compared by hash */
+typedef struct Band {
+    int x, y;
+    unsigned int width, height;
+} Band;
+
+static Display *dpy;
+static Window root;
+static Metric metrics[M_COUNT];
+static Band upper, lower;   /* username and info line; password and caps lines */
+static pid_t child = -1;
+
+static void
+die(const char *msg) {
+    fprintf(stderr, "bench: %s\n", msg);
+    if (child > 0)
+        kill(child, SIGTERM);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t
+now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sleep_us(long us) {
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+static void
+record(int metric, uint64_t value) {
+    Metric *m = &metrics[metric];
+    if (m->n == m->size) {
+        m->size = m->size ? m->size * 2 : 64;
+        if (!(m->samples = realloc(m->samples, m->size * sizeof(*m->samples))))
+            die("out of memory");
+    }
+    m->samples[m->n++] = value;
+}
+
+/* FNV-1a over the pixels of a band */
+static uint64_t
+band_hash(const Band *band) {
+    XImage *image = XGetImage(dpy, root, band->x, band->y, band->width, band->height, AllPlanes, ZPixmap);
+    uint64_t hash = 14695981039346656037ULL;
+
+    if (!image)
+        die("XGetImage failed");
+    for (int y = 0; y < image->height; y++) {
+        const unsigned char *row = (unsigned char *)image->data + y * image->bytes_per_line;
+        for (int x = 0; x < image->width * image->bits_per_pixel / 8; x++)
+            hash = (hash ^ row[x]) * 1099511628211ULL;
+    }
+    XDestroyImage(image);
+    return hash;
+}
+
+/* waits until the band differs from old, returns the time it took or 0 */
+static uint64_t
+wait_change(const Band *band, uint64_t old, uint64_t start, uint64_t *hash) {
+    for (;;) {
+        uint64_t h = band_hash(band), elapsed = now_us() - start;
+        if (h != old) {
+            if (hash)
+                *hash = h;
+            return elapsed ? elapsed : 1;
+        }
+        if (elapsed > TIMEOUT)
+            return 0;
+    }
+}
+
+/* waits until the band shows exactly target, returns the time it took or 0 */
+static uint64_t
+wait_hash(const Band *band, uint64_t target, uint64_t start) {
+    for (;;) {
+        uint64_t h = band_hash(band), elapsed = now_us() - start;
+        if (h == target)
+            return elapsed ? elapsed : 1;
+        if (elapsed > TIMEOUT)
+            return 0;
+    }
+}
+
+/* waits until the band stopped changing, returns its hash */
+static uint64_t
+wait_settled(const Band *band) {
+    uint64_t hash = band_hash(band), since = now_us();
+    while (now_us() - since < SETTLE) {
+        uint64_t h = band_hash(band);
+        if (h != hash) {
+            hash = h;
+            since = now_us();
+        }
+    }
+    return hash;
+}
+
+static void
+record_or_timeout(int metric, uint64_t value) {
+    if (value)
+        record(metric, value);
+    else
+        metrics[metric].timeouts++;
+}
+
+static void
+key(KeySym keysym) {
+    KeyCode code = XKeysymToKeycode(dpy, keysym);
+    if (!code)
+        die("no keycode for keysym");
+    XTestFakeKeyEvent(dpy, code, True, CurrentTime);
+    XTestFakeKeyEvent(dpy, code, False, CurrentTime);
+}
+
+static void
+type(const char *text) {
+    for (; *text; text++) {
+        char name[2] = { *text, '\0' };
+        key(XStringToKeysym(name));
+    }
+}
+
+/* waits for csxlock to hold the keyboard, by failing to grab it ourselves */
+static Bool
+wait_grabbed(void) {
+    uint64_t start = now_us();
+    while (now_us() - start < TIMEOUT) {
+        int ret = XGrabKeyboard(dpy, root, False, GrabModeAsync, GrabModeAsync, CurrentTime);
+        if (ret == AlreadyGrabbed || ret == GrabFrozen)
+            return True;
+        if (ret == GrabSuccess)
+            XUngrabKeyboard(dpy, CurrentTime);
+        XSync(dpy, False);
+    }
+    return False;
+}
+
+static pid_t
+spawn(char **argv) {
+    pid_t pid = fork();
+    if (pid == -1)
+        die("fork failed");
+    if (pid == 0) {
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+/* one run of csxlock: lock, exercise every scenario, unlock */
+static void
+iteration(char **argv, const char *password, int ngroups) {
+    uint64_t before = band_hash(&upper);
+    uint64_t start = now_us();
+    uint64_t empty, hashes[KEYS + 1], h;
+
+    child = spawn(argv);
+
+    if (!wait_grabbed())
+        die("csxlock did not grab the keyboard");
+    record(M_GRAB, now_us() - start);
+    record_or_timeout(M_FIRST_FRAME, wait_change(&upper, before, start, NULL));
+
+    empty = wait_settled(&lower);
+
+    /* single keys, remembering what every mask length looks like */
+    hashes[0] = empty;
+    for (int i = 1; i <= KEYS; i++) {
+        start = now_us();
+        key(XK_a);
+        XFlush(dpy);
+        record_or_timeout(M_KEY, wait_change(&lower, hashes[i - 1], start, &hashes[i]));
+        hashes[i] = wait_settled(&lower);
+    }
+    key(XK_Escape);
+    XFlush(dpy);
+    wait_hash(&lower, empty, now_us());
+
+    /* typing burst and backspace storm */
+    start = now_us();
+    for (int i = 0; i < KEYS; i++)
+        key(XK_a);
+    XFlush(dpy);
+    record_or_timeout(M_BURST, wait_hash(&lower, hashes[KEYS], start));
+
+    start = now_us();
+    for (int i = 0; i < KEYS; i++)
+        key(XK_BackSpace);
+    XFlush(dpy);
+    record_or_timeout(M_BACKSPACE, wait_hash(&lower, empty, start));
+
+    /* layout switches */
+    for (int i = 0; ngroups > 1 && i < SWITCHES; i++) {
+        h = wait_settled(&upper);
+        start = now_us();
+        XkbLockGroup(dpy, XkbUseCoreKbd, (i + 1) % ngroups);
+        XFlush(dpy);
+        record_or_timeout(M_LAYOUT, wait_change(&upper, h, start, NULL));
+    }
+    if (ngroups > 1)
+        XkbLockGroup(dpy, XkbUseCoreKbd, 0);
+
+    /* failed attempts, the first one shows what the failure looks like */
+    uint64_t failed = 0;
+    for (int i = 0; i <= FAILURES; i++) {
+        type("wrong");
+        XFlush(dpy);
+        h = wait_settled(&lower);
+        start = now_us();
+        key(XK_Return);
+        XFlush(dpy);
+        if (i == 0) {
+            wait_change(&lower, h, start, NULL);
+            failed = wait_settled(&lower);
+        } else {
+            record_or_timeout(M_AUTH_FAIL, wait_hash(&lower, failed, start));
+        }
+    }
+
+    /* unlock */
+    type(password);
+    XFlush(dpy);
+    wait_settled(&lower);
+    start = now_us();
+    key(XK_Return);
+    XFlush(dpy);
+    for (;;) {
+        int status;
+        if (waitpid(child, &status, WNOHANG) == child) {
+            record(M_AUTH_OK, now_us() - start);
+            break;
+        }
+        if (now_us() - start > TIMEOUT) {
+            metrics[M_AUTH_OK].timeouts++;
+            kill(child, SIGTERM);
+            waitpid(child, &status, 0);
+            break;
+        }
+        sleep_us(100);
+    }
+    child = -1;
+}
+
+static int
+compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of sorted samples */
+static uint64_t
+percentile(const Metric *m, unsigned int p) {
+    size_t rank = (m->n * p + 99) / 100;
+    return m->samples[rank ? rank - 1 : 0];
+}
+
+static void
+print_json(int iterations) {
+    printf("{\n  \"iterations\": %d,\n  \"metrics\": {\n", iterations);
+    for (int i = 0; i < M_COUNT; i++) {
+        Metric *m = &metrics[i];
+        printf("    \"%s\": { \"n\": %zu, \"timeouts\": %u", metric_names[i], m->n, m->timeouts);
+        if (m->n) {
+            uint64_t sum = 0;
+            qsort(m->samples, m->n, sizeof(*m->samples), compare);
+            for (size_t j = 0; j < m->n; j++)
+                sum += m->samples[j];
+            printf(", \"min\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu",
+                    (unsigned long long)m->samples[0],
+                    (unsigned long long)(sum / m->n),
+                    (unsigned long long)percentile(m, 50),
+                    (unsigned long long)percentile(m, 90),
+                    (unsigned long long)percentile(m, 99),
+                    (unsigned long long)m->samples[m->n - 1]);
+        }
+        printf(" }%s\n", i + 1 < M_COUNT ? "," : "");
+    }
+    printf("  }\n}\n");
+}
+
+int
+main(int argc, char **argv) {
+    int iterations = getenv("BENCH_ITERATIONS") ? atoi(getenv("BENCH_ITERATIONS")) : 10;
+    const char *password = getenv("BENCH_PASSWORD") ? getenv("BENCH_PASSWORD") : "benchpass";
+    int event, error, major = 1, minor = 0;
+    int ngroups = 0;
+
+    if (argc < 2)
+        die("usage: bench CSXLOCK [CSXLOCK OPTIONS...]");
+    if (!(dpy = XOpenDisplay(NULL)))
+        die("cannot open display");
+    if (!XTestQueryExtension(dpy, &event, &error, &major, &minor))
+        die("XTest extension missing");
+    root = DefaultRootWindow(dpy);
+
+    /* csxlock centers everything on the (single) Xvfb output */
+    {
+        int w = DisplayWidth(dpy, DefaultScreen(dpy));
+        int h = DisplayHeight(dpy, DefaultScreen(dpy));
+        upper.x = lower.x = w / 4;
+        upper.width = lower.width = w / 2;
+        upper.y = h / 2 - 120;
+        upper.height = 110;
+        lower.y = h / 2 + 1;
+        lower.height = 120;
+    }
+
+    /* layout switches need more than one group */
+    {
+        XkbDescPtr desc = XkbGetKeyboard(dpy, XkbControlsMask, XkbUseCoreKbd);
+        if (desc && desc->ctrls)
+            ngroups = desc->ctrls->num_groups;
+        if (desc)
+            XkbFreeKeyboard(desc, 0, True);
+        if (ngroups < 2)
+            fprintf(stderr, "bench: only one layout group, skipping layout switches\n");
+    }
+
+    for (int i = 0; i < iterations; i++)
+        iteration(argv + 1, password, ngroups);
+
+    print_json(iterations);
+    XCloseDisplay(dpy);
+    return 0;
+}
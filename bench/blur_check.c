@@ -0,0 +1,99 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+/*
+ * Checks every blur kernel the CPU supports: a constant image must come out
+ * of a pass unchanged, for every radius, and of a whole blur(). Widths and
+ * heights are odd so the vector kernels run their scalar tails too.
+ *
+ * usage: blur_check
+ */
+
+#include <stdio.h>
+
+#include "../blur.c"
+
+#define WIDTH   61
+#define HEIGHT  37
+
+static uint32_t pixels[HEIGHT * WIDTH], tmp[HEIGHT * WIDTH];
+
+static const uint32_t values[] = { 0xffffffff, 0x00000000, 0x80402010, 0xff00ff01 };
+
+static int
+supported(const Kernel *kernel) {
+#ifdef BLUR_X86
+    __builtin_cpu_init();
+    if (strcmp(kernel->name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(kernel->name, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+#endif
+    (void)kernel;
+    return 1;
+}
+
+static void
+fill(uint32_t value) {
+    for (int i = 0; i < WIDTH * HEIGHT; i++)
+        pixels[i] = value;
+}
+
+/* index of the first pixel which is not value, -1 when there is none */
+static int
+changed(uint32_t value) {
+    for (int i = 0; i < WIDTH * HEIGHT; i++)
+        if (pixels[i] != value)
+            return i;
+    return -1;
+}
+
+int
+main(void) {
+    int failed = 0;
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        const Kernel *kernel = &kernels[k];
+        if (!supported(kernel)) {
+            printf("%-6s skipped\n", kernel->name);
+            continue;
+        }
+        int bad = 0;
+        for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); v++) {
+            for (int radius = 1; radius <= 127; radius++) {
+                fill(values[v]);
+                kernel->horizontal(pixels, tmp, WIDTH, HEIGHT, WIDTH, radius, 0, HEIGHT);
+                kernel->vertical(tmp, pixels, WIDTH, HEIGHT, WIDTH, radius, 0, WIDTH);
+                int i = changed(values[v]);
+                if (i != -1) {
+                    fprintf(stderr, "%s: 0x%08x became 0x%08x at %d,%d with radius %d\n",
+                            kernel->name, values[v], pixels[i], i % WIDTH, i / WIDTH, radius);
+                    bad++;
+                }
+            }
+        }
+        printf("%-6s %s\n", kernel->name, bad ? "FAILED" : "ok");
+        failed |= bad;
+    }
+
+    /* the kernel blur() picks, three passes each */
+    for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); v++) {
+        for (int radius = 1; radius <= BLUR_MAX_RADIUS; radius += 9) {
+            fill(values[v]);
+            blur(pixels, WIDTH, HEIGHT, WIDTH, radius);
+            int i = changed(values[v]);
+            if (i != -1) {
+                fprintf(stderr, "blur: 0x%08x became 0x%08x with radius %d\n", values[v], pixels[i], radius);
+                failed = 1;
+            }
+        }
+    }
+    printf("blur   %s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
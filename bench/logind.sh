@@ -0,0 +1,32 @@
+#!/usr/bin/env sh
+#
+# Runs csxlock --logind against bench/logind_mock.py on a private bus and a
+# private Xvfb server: no real logind, no real suspend. Arguments are
+# passed on to csxlock, which must be built with LOGIND=1.
+#
+# environment: BENCH_SCREEN (default 1920x1080x24), plus everything
+# bench/logind_mock.py reads.
+
+set -e
+
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'kill $xvfb $bus 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+
+mkfifo "$tmp/displayfd"
+Xvfb -displayfd 3 -screen 0 "${BENCH_SCREEN:-1920x1080x24}" -nolisten tcp \
+    3>"$tmp/displayfd" >/dev/null 2>&1 &
+xvfb=$!
+read -r display < "$tmp/displayfd"
+export DISPLAY=":$display"
+
+# a session bus configuration lets anyone own any name
+dbus-daemon --session --nofork --print-address=4 --address="unix:path=$tmp/bus" \
+    4>"$tmp/address" >/dev/null 2>&1 &
+bus=$!
+while [ ! -s "$tmp/address" ]; do sleep 0.05; done
+export DBUS_SYSTEM_BUS_ADDRESS=$(head -n 1 "$tmp/address")
+unset XDG_SESSION_ID
+
+export USER="${USER:-bench}"
+"$dir/logind_mock.py" "$dir/csxlock" "$@"
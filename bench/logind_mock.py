@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+#
+# A stand-in for systemd-logind on a private bus, driving csxlock --logind
+# through a suspend: PrepareForSleep(true) must lock and close the delay
+# inhibitor only once the lock is painted, PrepareForSleep(false) must take
+# a new one, Unlock must end the lock. Prints the measured times as JSON.
+#
+# usage: logind_mock.py CSXLOCK [CSXLOCK OPTIONS...]
+# environment: DBUS_SYSTEM_BUS_ADDRESS (the private bus, see bench/logind.sh),
+# LOGIND_DELAY_MS (InhibitDelayMaxUSec reported, default 5000)
+
+import json
+import os
+import subprocess
+import sys
+import time
+
+from gi.repository import Gio, GLib
+
+NAME = "org.freedesktop.login1"
+MANAGER_PATH = "/org/freedesktop/login1"
+SESSION_PATH = "/org/freedesktop/login1/session/mock"
+TIMEOUT = 10  # seconds per step
+
+XML = """
+<node>
+  <interface name="org.freedesktop.login1.Manager">
+    <method name="Inhibit">
+      <arg type="s" direction="in"/><arg type="s" direction="in"/>
+      <arg type="s" direction="in"/><arg type="s" direction="in"/>
+      <arg type="h" direction="out"/>
+    </method>
+    <method name="GetSession">
+      <arg type="s" direction="in"/><arg type="o" direction="out"/>
+    </method>
+    <method name="GetSessionByPID">
+      <arg type="u" direction="in"/><arg type="o" direction="out"/>
+    </method>
+    <signal name="PrepareForSleep"><arg type="b"/></signal>
+    <property name="InhibitDelayMaxUSec" type="t" access="read"/>
+  </interface>
+  <interface name="org.freedesktop.login1.Session">
+    <method name="SetLockedHint"><arg type="b" direction="in"/></method>
+    <signal name="Lock"/>
+    <signal name="Unlock"/>
+  </interface>
+</node>
+"""
+
+delay_ms = int(os.environ.get("LOGIND_DELAY_MS", "5000"))
+loop = GLib.MainLoop()
+state = {"named": False, "inhibitors": 0, "held": False, "locked_hint": None, "released_at": None}
+conn = None
+
+
+def on_inhibitor_closed(fd, condition):
+    if os.read(fd, 1) == b"":
+        os.close(fd)
+        state["held"] = False
+        state["released_at"] = time.monotonic()
+        return False
+    return True
+
+
+def method_call(connection, sender, path, iface, method, params, invocation):
+    if method == "Inhibit":
+        r, w = os.pipe()
+        state["inhibitors"] += 1
+        state["held"] = True
+        GLib.io_add_watch(r, GLib.IO_IN | GLib.IO_HUP, on_inhibitor_closed)
+        # the list keeps a duplicate, once it is sent csxlock holds the only
+        # write end and the pipe hangs up when it closes it
+        fds = Gio.UnixFDList.new()
+        fds.append(w)
+        os.close(w)
+        invocation.return_value_with_unix_fd_list(GLib.Variant("(h)", (0,)), fds)
+    elif method in ("GetSession", "GetSessionByPID"):
+        invocation.return_value(GLib.Variant("(o)", (SESSION_PATH,)))
+    elif method == "SetLockedHint":
+        state["locked_hint"] = params.unpack()[0]
+        invocation.return_value(None)
+
+
+def get_property(connection, sender, path, iface, name):
+    return GLib.Variant("t", delay_ms * 1000)
+
+
+def emit(path, iface, signal, params=None):
+    conn.emit_signal(None, path, iface, signal, params)
+    conn.flush_sync(None)
+
+
+def wait_for(predicate):
+    deadline = time.monotonic() + TIMEOUT
+    context = loop.get_context()
+    while not predicate():
+        if time.monotonic() > deadline:
+            return False
+        context.iteration(True)
+    return True
+
+
+def on_bus(connection, name):
+    global conn
+    conn = connection
+    info = Gio.DBusNodeInfo.new_for_xml(XML)
+    connection.register_object(MANAGER_PATH, info.interfaces[0], method_call, get_property, None)
+    connection.register_object(SESSION_PATH, info.interfaces[1], method_call, get_property, None)
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit("usage: logind_mock.py CSXLOCK [CSXLOCK OPTIONS...]")
+
+    Gio.bus_own_name(Gio.BusType.SYSTEM, NAME, Gio.BusNameOwnerFlags.NONE,
+                     on_bus, lambda c, n: state.update(named=True),
+                     lambda c, n: sys.exit("can not own " + NAME))
+    if not wait_for(lambda: state["named"]):
+        sys.exit("no bus")
+
+    result = {"budget_ms": delay_ms}
+    csxlock = subprocess.Popen(sys.argv[1:] + ["--logind"])
+    try:
+        ok = wait_for(lambda: state["held"])
+        result["inhibitor_taken"] = ok
+
+        # give csxlock time to settle in its idle state
+        deadline = time.monotonic() + 0.5
+        wait_for(lambda: time.monotonic() > deadline)
+
+        start = time.monotonic()
+        emit(MANAGER_PATH, "org.freedesktop.login1.Manager", "PrepareForSleep", GLib.Variant("(b)", (True,)))
+        ok = wait_for(lambda: not state["held"])
+        result["sleep_lock_ms"] = round((state["released_at"] - start) * 1000, 2) if ok else None
+        result["within_budget"] = ok and result["sleep_lock_ms"] <= delay_ms
+        ok = wait_for(lambda: state["locked_hint"] is True)
+        result["locked_hint"] = ok
+
+        emit(MANAGER_PATH, "org.freedesktop.login1.Manager", "PrepareForSleep", GLib.Variant("(b)", (False,)))
+        result["inhibitor_retaken"] = wait_for(lambda: state["held"] and state["inhibitors"] == 2)
+
+        emit(SESSION_PATH, "org.freedesktop.login1.Session", "Unlock")
+        result["unlocked"] = wait_for(lambda: state["locked_hint"] is False)
+    finally:
+        csxlock.terminate()
+        csxlock.wait()
+
+    print(json.dumps(result, indent=2))
+    checks = ("inhibitor_taken", "within_budget", "locked_hint", "inhibitor_retaken", "unlocked")
+    sys.exit(0 if all(result[k] for k in checks) else 1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,56 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+/*
+ * Stub PAM module for the benchmarks. Accepts exactly the password given as
+ * "password=..." in the PAM configuration, optionally after "delay=MS"
+ * milliseconds to imitate a slow authentication backend.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>       // nanosleep()
+#include <security/pam_modules.h>
+#include <security/pam_ext.h>   // pam_get_authtok()
+
+int
+pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv) {
+    const char *expected = "";
+    const char *token = NULL;
+    long delay = 0;
+
+    (void)flags;
+
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "password=", 9) == 0)
+            expected = argv[i] + 9;
+        else if (strncmp(argv[i], "delay=", 6) == 0)
+            delay = strtol(argv[i] + 6, NULL, 10);
+    }
+
+    if (pam_get_authtok(pamh, PAM_AUTHTOK, &token, NULL) != PAM_SUCCESS || token == NULL)
+        return PAM_AUTH_ERR;
+
+    if (delay > 0) {
+        struct timespec ts = { delay / 1000, (delay % 1000) * 1000000 };
+        nanosleep(&ts, NULL);
+    }
+
+    return strcmp(token, expected) == 0 ? PAM_SUCCESS : PAM_AUTH_ERR;
+}
+
+int
+pam_sm_setcred(pam_handle_t *pamh, int flags, int argc, const char **argv) {
+    (void)pamh;
+    (void)flags;
+    (void)argc;
+    (void)argv;
+    return PAM_SUCCESS;
+}
@@ -0,0 +1,289 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+/*
+ * Headless micro-benchmark of the frame path. Replays a recorded event
+ * sequence through the password prompt of csxlock, assembles every frame
+ * with the same prompt_info() and prompt_frame() as display_render() and
+ * draws it on csxlock's canvases, into an in-memory framebuffer instead of
+ * an X server. Measures the cost of every frame: time, backend calls and
+ * pixels written.
+ *
+ * A recording is a text file with one event per line:
+ *
+ *   key C          a printable character
+ *   key Return     submit, key BackSpace and key Escape as well
+ *   motion         pointer motion
+ *   caps on|off    caps lock state
+ *   verdict ok|fail  the authentication helper answered
+ *   frame          the main loop draws, after a batch of events
+ *
+ * Blank lines and lines starting with '#' are ignored. The recording is
+ * replayed from a fresh prompt every iteration.
+ *
+ * Results are printed to stdout as JSON with percentiles.
+ *
+ * usage: replay [RECORDING]    (default bench/typing.rec)
+ * environment: BENCH_ITERATIONS (default 1000), REPLAY_OUTPUTS (outputs
+ * side by side, default 2, at most 8)
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../fb.h"
+#include "../prompt.h"
+#include "../render.h"
+
+#define OUTPUT_WIDTH    1920
+#define OUTPUT_HEIGHT   1080
+#define MAX_OUTPUTS     8
+#define MAX_EVENTS      4096
+
+/* colors of the default theme */
+#define BACKGROUND      0xff000000
+#define TEXT_COLOR      0xffffffff
+#define ERROR_COLOR     0xffff0000
+
+typedef enum {
+    E_KEY,
+    E_MOTION,
+    E_CAPS,
+    E_VERDICT,
+    E_FRAME,
+} EventType;
+
+typedef struct {
+    EventType type;
+    PromptKey key;
+    char c;
+    int value;          /* caps on, verdict ok */
+} Event;
+
+static Event events[MAX_EVENTS];
+static int nevents;
+
+static uint64_t *samples;
+static size_t nsamples;
+
+static uint64_t
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of sorted samples */
+static uint64_t
+percentile(unsigned int p) {
+    size_t rank = (nsamples * p + 99) / 100;
+    return samples[rank ? rank - 1 : 0];
+}
+
+/*
+ * Parses one line of a recording. Returns -1 when it is not understood.
+ *
+ */
+static int
+parse_event(Event *e, const char *line) {
+    char word[32], arg[32];
+    int n = sscanf(line, "%31s %31s", word, arg);
+
+    memset(e, 0, sizeof(*e));
+    if (n >= 2 && strcmp(word, "key") == 0) {
+        e->type = E_KEY;
+        if (strcmp(arg, "Return") == 0)
+            e->key = PROMPT_KEY_SUBMIT;
+        else if (strcmp(arg, "Escape") == 0)
+            e->key = PROMPT_KEY_CANCEL;
+        else if (strcmp(arg, "BackSpace") == 0)
+            e->key = PROMPT_KEY_ERASE;
+        else if (arg[1] == '\0')
+            e->c = arg[0];
+        else
+            return -1;
+    } else if (n == 1 && strcmp(word, "motion") == 0) {
+        e->type = E_MOTION;
+    } else if (n == 1 && strcmp(word, "frame") == 0) {
+        e->type = E_FRAME;
+    } else if (n >= 2 && strcmp(word, "caps") == 0) {
+        e->type = E_CAPS;
+        e->value = strcmp(arg, "on") == 0;
+    } else if (n >= 2 && strcmp(word, "verdict") == 0) {
+        e->type = E_VERDICT;
+        e->value = strcmp(arg, "ok") == 0;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void
+load(const char *path) {
+    char line[256];
+    int lineno = 0;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line + strspn(line, " \t");
+        lineno++;
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if (nevents == MAX_EVENTS) {
+            fprintf(stderr, "%s: more than %d events\n", path, MAX_EVENTS);
+            exit(1);
+        }
+        if (parse_event(&events[nevents++], p) == -1) {
+            fprintf(stderr, "%s:%d: unknown event\n", path, lineno);
+            exit(1);
+        }
+    }
+    fclose(f);
+}
+
+int
+main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "bench/typing.rec";
+    const char *env;
+    int iterations = 1000, noutputs = 2;
+    char mask[256], password[256], info[256];
+    static FbCanvas canvases[MAX_OUTPUTS];
+    Framebuffer fb;
+    Prompt prompt;
+
+    if ((env = getenv("BENCH_ITERATIONS")))
+        iterations = atoi(env);
+    if ((env = getenv("REPLAY_OUTPUTS")))
+        noutputs = atoi(env);
+    if (iterations < 1 || noutputs < 1 || noutputs > MAX_OUTPUTS) {
+        fprintf(stderr, "replay: bad BENCH_ITERATIONS or REPLAY_OUTPUTS\n");
+        return 1;
+    }
+
+    load(path);
+    size_t nframes = 0;
+    for (int i = 0; i < nevents; i++)
+        nframes += events[i].type == E_FRAME;
+    if (nframes == 0) {
+        fprintf(stderr, "%s: no frames\n", path);
+        return 1;
+    }
+
+    samples = malloc(sizeof(*samples) * nframes * iterations);
+    if (samples == NULL || fb_init(&fb, OUTPUT_WIDTH * noutputs, OUTPUT_HEIGHT) == -1) {
+        fprintf(stderr, "replay: out of memory\n");
+        return 1;
+    }
+
+    /* the default --passchar */
+    memset(mask, '*', sizeof(mask));
+
+    for (int i = 0; i < noutputs; i++) {
+        RenderRect output = { i * OUTPUT_WIDTH, 0, OUTPUT_WIDTH, OUTPUT_HEIGHT };
+        fb_canvas_init(&canvases[i], &fb, BACKGROUND, TEXT_COLOR);
+        widget_set(&canvases[i].canvas, WIDGET_USERNAME, "bench", 5, TEXT_COLOR);
+        canvas_layout(&canvases[i].canvas, &output);
+    }
+
+    unsigned long ops = 0, pixels = 0;
+    uint64_t start = now();
+
+    for (int it = 0; it < iterations; it++) {
+        int pending = 0, caps = 0;
+        prompt_init(&prompt, password, sizeof(password));
+
+        for (int i = 0; i < nevents; i++) {
+            const Event *e = &events[i];
+            PromptAction action = PROMPT_NONE;
+
+            switch (e->type) {
+                case E_KEY:
+                    action = prompt_key(&prompt, e->key, e->c, pending);
+                    break;
+                case E_MOTION:
+                    prompt_input(&prompt);
+                    break;
+                case E_CAPS:
+                    caps = e->value;
+                    break;
+                case E_VERDICT:
+                    if (pending) {
+                        pending = 0;
+                        action = prompt_verdict(&prompt, e->value);
+                    }
+                    break;
+                case E_FRAME: {
+                    /* what display_render() does for a display, with a
+                     * fixed clock and layout */
+                    unsigned long ops_before = fb.ops, pixels_before = fb.pixels;
+                    uint64_t t = now();
+                    PromptFrame frame = { .info = info, .caps = caps };
+                    frame.pass_error = prompt_text(&prompt, pending, mask, 0, &frame.pass, &frame.pass_len);
+                    frame.info_len = prompt_info(info, sizeof(info), "2020-01-01 12:00", "us", "");
+
+                    for (int j = 0; j < noutputs; j++) {
+                        Canvas *canvas = &canvases[j].canvas;
+                        prompt_frame(canvas, &frame, TEXT_COLOR, ERROR_COLOR);
+                        canvas_render(canvas);
+                    }
+                    samples[nsamples++] = now() - t;
+                    ops += fb.ops - ops_before;
+                    pixels += fb.pixels - pixels_before;
+                    break;
+                }
+            }
+
+            /* the helper accepts every password, the verdict is recorded */
+            if (action == PROMPT_SUBMIT) {
+                prompt_submitted(&prompt, 1);
+                pending = 1;
+            }
+        }
+    }
+
+    uint64_t elapsed = now() - start;
+    uint64_t sum = 0;
+    qsort(samples, nsamples, sizeof(*samples), compare);
+    for (size_t i = 0; i < nsamples; i++)
+        sum += samples[i];
+
+    printf("{\n  \"recording\": \"%s\",\n  \"iterations\": %d,\n  \"outputs\": %d,\n",
+            path, iterations, noutputs);
+    printf("  \"events_per_second\": %.0f,\n",
+            (double)nevents * iterations * 1e9 / (elapsed ? elapsed : 1));
+    printf("  \"frames\": %zu,\n", nsamples);
+    printf("  \"frame_ns\": { \"min\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, "
+            "\"p99\": %llu, \"max\": %llu },\n",
+            (unsigned long long)samples[0],
+            (unsigned long long)(sum / nsamples),
+            (unsigned long long)percentile(50),
+            (unsigned long long)percentile(90),
+            (unsigned long long)percentile(99),
+            (unsigned long long)samples[nsamples - 1]);
+    printf("  \"ops_per_frame\": %.1f,\n  \"pixels_per_frame\": %.0f\n}\n",
+            (double)ops / nsamples, (double)pixels / nsamples);
+
+    fb_free(&fb);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,37 @@
+#!/usr/bin/env sh
+#
+# Runs the end-to-end benchmarks against a private Xvfb server and prints
+# the results as JSON. Arguments are passed on to csxlock. Fails when
+# csxlock allocated on the heap while running its event loop.
+#
+# environment: BENCH_SCREEN (default 1920x1080x24), BENCH_LAYOUTS (default
+# "us,de", needs setxkbmap), plus everything bench/bench.c reads.
+
+set -e
+
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'kill $xvfb 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+
+# -displayfd reports the display number once the server accepts clients
+mkfifo "$tmp/displayfd"
+Xvfb -displayfd 3 -screen 0 "${BENCH_SCREEN:-1920x1080x24}" -nolisten tcp \
+    3>"$tmp/displayfd" >/dev/null 2>&1 &
+xvfb=$!
+read -r display < "$tmp/displayfd"
+export DISPLAY=":$display"
+
+# a second layout group for the layout switch runs
+setxkbmap -layout "${BENCH_LAYOUTS:-us,de}" 2>/dev/null || true
+
+export USER="${USER:-bench}"
+"$dir/bench" "$dir/csxlock" "$@" --stats="$tmp/stats"
+
+# bench/csxlock counts its heap allocations, the event loop must not make
+# any once it runs
+awk '
+    $1 == "frame_allocs" { runs++; if ($2 == "count=0" || $NF != "max=0") bad++ }
+    END {
+        if (runs == 0) { print "frame_allocs: no statistics written" > "/dev/stderr"; exit 1 }
+        if (bad) { printf "frame_allocs: %d of %d runs allocated in the event loop\n", bad, runs > "/dev/stderr"; exit 1 }
+    }' "$tmp/stats"
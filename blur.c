@@ -0,0 +1,359 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>     // sysconf()
+#if defined(__x86_64__) || defined(__i386__)
+#define BLUR_X86
+#include <immintrin.h>
+#endif
+
+#include "blur.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define MAX_THREADS 16
+
+/*
+ * A box blur pass reads src and writes dst, both with stride pixels per row.
+ * Horizontal passes handle the rows from..to, vertical ones the columns.
+ * Sums of a box are kept in 16 bits: 255 * (2 * 127 + 1) still fits, and the
+ * division is a multiplication by 65536 / (2 * radius + 1) keeping the high
+ * half. The reciprocal is rounded up: truncated, a box of 255s averaged to
+ * 254 and every pass darkened the image. Rounded up, its error times the
+ * largest sum stays below 65536, so a constant box gives back its value.
+ */
+typedef void (*Pass)(const uint32_t *src, uint32_t *dst, int width, int height,
+        size_t stride, int radius, int from, int to);
+
+typedef struct Kernel {
+    const char *name;
+    Pass horizontal, vertical;
+} Kernel;
+
+static unsigned int
+reciprocal(int radius) {
+    return (65536 + 2 * radius) / (2 * radius + 1);
+}
+
+static void
+horizontal_scalar(const uint32_t *src, uint32_t *dst, int width, int height,
+        size_t stride, int radius, int from, int to) {
+    unsigned int inv = reciprocal(radius);
+    (void)height;
+
+    for (int y = from; y < to; y++) {
+        const uint8_t *in = (const uint8_t *)(src + y * stride);
+        uint8_t *out = (uint8_t *)(dst + y * stride);
+        unsigned int sum[4];
+
+        for (int c = 0; c < 4; c++) {
+            sum[c] = in[c] * (radius + 1);
+            for (int i = 1; i <= radius; i++)
+                sum[c] += in[4 * MIN(i, width - 1) + c];
+        }
+        for (int x = 0; x < width; x++) {
+            int add = 4 * MIN(x + radius + 1, width - 1), sub = 4 * MAX(x - radius, 0);
+            for (int c = 0; c < 4; c++) {
+                out[4 * x + c] = sum[c] * inv >> 16;
+                sum[c] += in[add + c] - in[sub + c];
+            }
+        }
+    }
+}
+
+static void
+vertical_scalar(const uint32_t *src, uint32_t *dst, int width, int height,
+        size_t stride, int radius, int from, int to) {
+    unsigned int inv = reciprocal(radius);
+    int n = 4 * (to - from);
+    unsigned int *sum = malloc(n * sizeof(unsigned int));
+    (void)width;
+
+    if (sum == NULL)
+        return;
+#define ROW(y) ((const uint8_t *)(src + (y) * stride + from))
+    for (int j = 0; j < n; j++) {
+        sum[j] = ROW(0)[j] * (radius + 1);
+        for (int i = 1; i <= radius; i++)
+            sum[j] += ROW(MIN(i, height - 1))[j];
+    }
+    for (int y = 0; y < height; y++) {
+        const uint8_t *add = ROW(MIN(y + radius + 1, height - 1)), *sub = ROW(MAX(y - radius, 0));
+        uint8_t *out = (uint8_t *)(dst + y * stride + from);
+        for (int j = 0; j < n; j++) {
+            out[j] = sum[j] * inv >> 16;
+            sum[j] += add[j] - sub[j];
+        }
+    }
+#undef ROW
+    free(sum);
+}
+
+#ifdef BLUR_X86
+/*
+ * SSE2: the horizontal pass runs two rows at once, the channels of one pixel
+ * of each row fill the eight 16 bit lanes. The vertical pass handles two
+ * neighbouring pixels of a row per vector.
+ */
+__attribute__((target("sse2")))
+static void
+horizontal_sse2(const uint32_t *src, uint32_t *dst, int width, int height,
+        size_t stride, int radius, int from, int to) {
+    const __m128i inv = _mm_set1_epi16(reciprocal(radius));
+    const __m128i zero = _mm_setzero_si128();
+    int y = from;
+
+    for (; y + 2 <= to; y += 2) {
+        const uint32_t *a = src + y * stride, *b = a + stride;
+        uint32_t *oa = dst + y * stride, *ob = oa + stride;
+#define LOAD(x) _mm_unpacklo_epi8(_mm_set_epi32(0, 0, (int)b[x], (int)a[x]), zero)
+        __m128i sum = _mm_mullo_epi16(LOAD(0), _mm_set1_epi16(radius + 1));
+        for (int i = 1; i <= radius; i++)
+            sum = _mm_add_epi16(sum, LOAD(MIN(i, width - 1)));
+        for (int x = 0; x < width; x++) {
+            __m128i out = _mm_packus_epi16(_mm_mulhi_epu16(sum, inv), zero);
+            oa[x] = _mm_cvtsi128_si32(out);
+            ob[x] = _mm_cvtsi128_si32(_mm_srli_si128(out, 4));
+            sum = _mm_add_epi16(sum, LOAD(MIN(x + radius + 1, width - 1)));
+            sum = _mm_sub_epi16(sum, LOAD(MAX(x - radius, 0)));
+        }
+#undef LOAD
+    }
+    if (y < to)
+        horizontal_scalar(src, dst, width, height, stride, radius, y, to);
+}
+
+__attribute__((target("sse2")))
+static void
+vertical_sse2(const uint32_t *src, uint32_t *dst, int width, int height,
+        size_t stride, int radius, int from, int to) {
+    const __m128i inv = _mm_set1_epi16(reciprocal(radius));
+    const __m128i zero = _mm_setzero_si128();
+    int n = (to - from) / 2;
+    __m128i *sum = malloc(n * sizeof(__m128i) + 16);
+    __m128i *sums = (__m128i *)(((uintptr_t)sum + 15) & ~(uintptr_t)15);
+
+    if (sum == NULL)
+        return;
+#define LOAD(y, j) _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + (y) * stride + from + 2 * (j))), zero)
+    for (int j = 0; j < n; j++) {
+        sums[j] = _mm_mullo_epi16(LOAD(0, j), _mm_set1_epi16(radius + 1));
+        for (int i = 1; i <= radius; i++)
+            sums[j] = _mm_add_epi16(sums[j], LOAD(MIN(i, height - 1), j));
+    }
+    for (int y = 0; y < height; y++) {
+        int add = MIN(y + radius + 1, height - 1), sub = MAX(y - radius, 0);
+        for (int j = 0; j < n; j++) {
+            __m128i out = _mm_packus_epi16(_mm_mulhi_epu16(sums[j], inv), zero);
+            _mm_storel_epi64((__m128i *)(dst + y * stride + from + 2 * j), out);
+            sums[j] = _mm_sub_epi16(_mm_add_epi16(sums[j], LOAD(add, j)), LOAD(sub, j));
+        }
+    }
+#undef LOAD
+    free(sum);
+    if (from + 2 * n < to)
+        vertical_scalar(src, dst, width, height, stride, radius, from + 2 * n, to);
+}
+
+/*
+ * AVX2: four rows, or four neighbouring pixels, per vector of sixteen lanes.
+ */
+__attribute__((target("avx2")))
+static __m128i
+pack_avx2(__m256i v) {
+    return _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2")))
+static void
+horizontal_avx2(const uint32_t *src, uint32_t *dst, int width, int height,
+        size_t stride, int radius, int from, int to) {
+    const __m256i inv = _mm256_set1_epi16(reciprocal(radius));
+    int y = from;
+
+    for (; y + 4 <= to; y += 4) {
+        const uint32_t *r0 = src + y * stride, *r1 = r0 + stride, *r2 = r1 + stride, *r3 = r2 + stride;
+        uint32_t *out = dst + y * stride;
+#define LOAD(x) _mm256_cvtepu8_epi16(_mm_set_epi32((int)r3[x], (int)r2[x], (int)r1[x], (int)r0[x]))
+        __m256i sum = _mm256_mullo_epi16(LOAD(0), _mm256_set1_epi16(radius + 1));
+        for (int i = 1; i <= radius; i++)
+            sum = _mm256_add_epi16(sum, LOAD(MIN(i, width - 1)));
+        for (int x = 0; x < width; x++) {
+            __m128i p = pack_avx2(_mm256_mulhi_epu16(sum, inv));
+            out[x] = _mm_cvtsi128_si32(p);
+            out[x + stride] = _mm_extract_epi32(p, 1);
+            out[x + 2 * stride] = _mm_extract_epi32(p, 2);
+            out[x + 3 * stride] = _mm_extract_epi32(p, 3);
+            sum = _mm256_add_epi16(sum, LOAD(MIN(x + radius + 1, width - 1)));
+            sum = _mm256_sub_epi16(sum, LOAD(MAX(x - radius, 0)));
+        }
+#undef LOAD
+    }
+    if (y < to)
+        horizontal_sse2(src, dst, width, height, stride, radius, y, to);
+}
+
+__attribute__((target("avx2")))
+static void
+vertical_avx2(const uint32_t *src, uint32_t *dst, int width, int height,
+        size_t stride, int radius, int from, int to) {
+    const __m256i inv = _mm256_set1_epi16(reciprocal(radius));
+    int n = (to - from) / 4;
+    __m256i *sum = malloc(n * sizeof(__m256i) + 32);
+    __m256i *sums = (__m256i *)(((uintptr_t)sum + 31) & ~(uintptr_t)31);
+
+    if (sum == NULL)
+        return;
+#define LOAD(y, j) _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + (y) * stride + from + 4 * (j))))
+    for (int j = 0; j < n; j++) {
+        sums[j] = _mm256_mullo_epi16(LOAD(0, j), _mm256_set1_epi16(radius + 1));
+        for (int i = 1; i <= radius; i++)
+            sums[j] = _mm256_add_epi16(sums[j], LOAD(MIN(i, height - 1), j));
+    }
+    for (int y = 0; y < height; y++) {
+        int add = MIN(y + radius + 1, height - 1), sub = MAX(y - radius, 0);
+        for (int j = 0; j < n; j++) {
+            _mm_storeu_si128((__m128i *)(dst + y * stride + from + 4 * j),
+                    pack_avx2(_mm256_mulhi_epu16(sums[j], inv)));
+            sums[j] = _mm256_sub_epi16(_mm256_add_epi16(sums[j], LOAD(add, j)), LOAD(sub, j));
+        }
+    }
+#undef LOAD
+    free(sum);
+    if (from + 4 * n < to)
+        vertical_sse2(src, dst, width, height, stride, radius, from + 4 * n, to);
+}
+#endif
+
+static const Kernel kernels[] = {
+#ifdef BLUR_X86
+    { "avx2", horizontal_avx2, vertical_avx2 },
+    { "sse2", horizontal_sse2, vertical_sse2 },
+#endif
+    { "scalar", horizontal_scalar, vertical_scalar },
+};
+
+/*
+ * Picks the widest kernel the CPU supports, once.
+ *
+ */
+static const Kernel *
+kernel_select(void) {
+    static const Kernel *kernel;
+
+    if (kernel)
+        return kernel;
+    kernel = &kernels[sizeof(kernels) / sizeof(kernels[0]) - 1];
+#ifdef BLUR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernel = &kernels[0];
+    else if (__builtin_cpu_supports("sse2"))
+        kernel = &kernels[1];
+#endif
+    return kernel;
+}
+
+const char *
+blur_kernel(void) {
+    return kernel_select()->name;
+}
+
+/* one tile of a pass, run by a thread */
+typedef struct Job {
+    Pass pass;
+    const uint32_t *src;
+    uint32_t *dst;
+    int width, height;
+    size_t stride;
+    int radius;
+    int from, to;
+} Job;
+
+static void *
+job_run(void *arg) {
+    Job *job = arg;
+    job->pass(job->src, job->dst, job->width, job->height, job->stride, job->radius, job->from, job->to);
+    return NULL;
+}
+
+/*
+ * Splits a pass over count rows or columns into bands, one per thread. Bands
+ * start on multiples of four, so the vector kernels rarely need their scalar
+ * tails. The caller's thread runs the last band.
+ *
+ */
+static void
+pass_run(Pass pass, const uint32_t *src, uint32_t *dst, int width, int height,
+        size_t stride, int radius, int count, int nthreads) {
+    pthread_t threads[MAX_THREADS];
+    Job jobs[MAX_THREADS];
+    int band = ((count + nthreads - 1) / nthreads + 3) & ~3;
+    int started = 0, n = 0;
+
+    for (int from = 0; from < count; from += band, n++) {
+        jobs[n] = (Job){ pass, src, dst, width, height, stride, radius, from, MIN(from + band, count) };
+    }
+    for (int i = 0; i < n - 1; i++) {
+        if (pthread_create(&threads[i], NULL, job_run, &jobs[i]) != 0)
+            break;
+        started++;
+    }
+    for (int i = started; i < n; i++)
+        job_run(&jobs[i]);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/*
+ * Radii of three box blurs approximating a Gaussian with the given standard
+ * deviation (http://blog.ivank.net/fastest-gaussian-blur.html).
+ *
+ */
+static void
+box_radii(int sigma, int radii[3]) {
+    double ideal = sqrt(12.0 * sigma * sigma / 3 + 1);
+    int lower = (int)ideal;
+    if (lower % 2 == 0)
+        lower--;
+    int upper = lower + 2;
+    int m = (int)round((12.0 * sigma * sigma - 3 * lower * lower - 12 * lower - 9) / (-4 * lower - 4));
+
+    for (int i = 0; i < 3; i++)
+        radii[i] = MIN(((i < m ? lower : upper) - 1) / 2, 127);
+}
+
+void
+blur(uint32_t *pixels, int width, int height, size_t stride, int radius) {
+    const Kernel *kernel = kernel_select();
+    uint32_t *tmp;
+    int radii[3];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cpus < 1 ? 1 : MIN(cpus, MAX_THREADS);
+
+    if (radius <= 0 || width <= 0 || height <= 0)
+        return;
+    if ((tmp = malloc((size_t)height * stride * sizeof(uint32_t))) == NULL)
+        return;
+
+    box_radii(MIN(radius, BLUR_MAX_RADIUS), radii);
+    for (int i = 0; i < 3; i++) {
+        if (radii[i] <= 0)
+            continue;
+        pass_run(kernel->horizontal, pixels, tmp, width, height, stride, radii[i], height, nthreads);
+        pass_run(kernel->vertical, tmp, pixels, width, height, stride, radii[i], width, nthreads);
+    }
+
+    free(tmp);
+}
@@ -0,0 +1,28 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#ifndef CSXLOCK_BLUR_H
+#define CSXLOCK_BLUR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* largest supported radius, the box sums must fit 16 bits */
+#define BLUR_MAX_RADIUS 100
+
+/*
+ * Blurs 32 bit pixels in place, every byte is a channel. Three box blurs
+ * approximate a Gaussian with the given radius (standard deviation).
+ */
+void blur(uint32_t *pixels, int width, int height, size_t stride, int radius);
+
+/* name of the kernel picked for this CPU: "avx2", "sse2" or "scalar" */
+const char *blur_kernel(void);
+
+#endif /* CSXLOCK_BLUR_H */
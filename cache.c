@@ -0,0 +1,129 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>     // PATH_MAX
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+/* first line of a resource cache file */
+#define RESOURCE_MAGIC "csxlock-resources 1\n"
+
+uint64_t
+cache_hash(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *p = data;
+    while (size--)
+        hash = (hash ^ *p++) * 0x100000001b3ULL;
+    return hash;
+}
+
+int
+cache_dir(char *buf, size_t size) {
+    const char *base = getenv("XDG_CACHE_HOME");
+
+    if (base && *base) {
+        snprintf(buf, size, "%s/csxlock", base);
+    } else if ((base = getenv("HOME"))) {
+        snprintf(buf, size, "%s/.cache", base);
+        mkdir(buf, 0700);
+        snprintf(buf, size, "%s/.cache/csxlock", base);
+    } else {
+        return -1;
+    }
+    if (mkdir(buf, 0700) == -1 && access(buf, W_OK) == -1)
+        return -1;
+    return 0;
+}
+
+/*
+ * The file is a few lines of text: the magic, the key, the font path hash,
+ * one line per color and the font name last, as it may contain anything but
+ * a newline.
+ *
+ */
+int
+resource_cache_load(ResourceCache *cache, const char *path, uint64_t key) {
+    char line[512];
+    unsigned long long value;
+    FILE *f;
+    int ok = 0;
+
+    memset(cache, 0, sizeof(*cache));
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+
+    if (!fgets(line, sizeof(line), f) || strcmp(line, RESOURCE_MAGIC) != 0)
+        goto out;
+    if (!fgets(line, sizeof(line), f) || sscanf(line, "key %llx", &value) != 1 || value != key)
+        goto out;
+    cache->key = key;
+    if (!fgets(line, sizeof(line), f) || sscanf(line, "font_path %llx", &value) != 1)
+        goto out;
+    cache->font_path = value;
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned int red, green, blue;
+        if (sscanf(line, "color %x %x %x", &red, &green, &blue) == 3) {
+            if (cache->ncolors == CACHE_COLORS)
+                goto out;
+            cache->colors[cache->ncolors].red = red;
+            cache->colors[cache->ncolors].green = green;
+            cache->colors[cache->ncolors].blue = blue;
+            cache->ncolors++;
+        } else if (strncmp(line, "font ", 5) == 0) {
+            /* a cut XLFD must never be opened, the entry is stale */
+            size_t len = strcspn(line + 5, "\n");
+            if (len >= sizeof(cache->font))
+                goto out;
+            memcpy(cache->font, line + 5, len);
+            cache->font[len] = '\0';
+            ok = 1;
+            break;
+        } else {
+            goto out;
+        }
+    }
+
+out:
+    fclose(f);
+    if (!ok)
+        memset(cache, 0, sizeof(*cache));
+    return ok ? 0 : -1;
+}
+
+/*
+ * Written to a temporary file renamed over the old one, a concurrent run
+ * never reads half an entry.
+ *
+ */
+void
+resource_cache_store(const ResourceCache *cache, const char *path) {
+    char tmp[PATH_MAX];
+    FILE *f;
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >= sizeof(tmp))
+        return;
+    if ((f = fopen(tmp, "w")) == NULL)
+        return;
+
+    fputs(RESOURCE_MAGIC, f);
+    fprintf(f, "key %016llx\n", (unsigned long long)cache->key);
+    fprintf(f, "font_path %016llx\n", (unsigned long long)cache->font_path);
+    for (int i = 0; i < cache->ncolors; i++)
+        fprintf(f, "color %04x %04x %04x\n",
+                cache->colors[i].red, cache->colors[i].green, cache->colors[i].blue);
+    fprintf(f, "font %s\n", cache->font);
+
+    if (fclose(f) != 0 || rename(tmp, path) == -1)
+        unlink(tmp);
+}
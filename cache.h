@@ -0,0 +1,42 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#ifndef CSXLOCK_CACHE_H
+#define CSXLOCK_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+/* FNV-1a, entries are keyed by everything they were derived from */
+uint64_t cache_hash(uint64_t hash, const void *data, size_t size);
+
+/* $XDG_CACHE_HOME/csxlock or ~/.cache/csxlock, created when missing */
+int cache_dir(char *buf, size_t size);
+
+/* colors kept per entry */
+#define CACHE_COLORS 8
+
+/* what the server resolved for a set of options, remembered between runs */
+typedef struct ResourceCache {
+    uint64_t key;               /* server and option values it is valid for */
+    uint64_t font_path;         /* hash of the font path the font was resolved on */
+    char font[256];             /* fully resolved XLFD, empty when unknown */
+    int ncolors;
+    struct {
+        unsigned short red, green, blue;
+    } colors[CACHE_COLORS];
+} ResourceCache;
+
+/* returns 0 when path holds an entry for the key, -1 otherwise */
+int resource_cache_load(ResourceCache *cache, const char *path, uint64_t key);
+void resource_cache_store(const ResourceCache *cache, const char *path);
+
+#endif /* CSXLOCK_CACHE_H */
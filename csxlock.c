@@ -31,32 +31,74 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>      // isprint()
 #include <time.h>       // time()
+#include <errno.h>
+#include <stdint.h>     // uint64_t
 #include <getopt.h>     // getopt_long()
 #include <unistd.h>
 #include <signal.h>
-#include <sys/mman.h>   // mlock()
+#include <sys/timerfd.h> // timerfd_create()
+#include <poll.h>
 #include <X11/keysym.h>
 #include <X11/Xlib.h>
+#include <X11/Xatom.h>    // XA_FONT
 #include <X11/Xutil.h>
 #include <X11/extensions/dpms.h>
 #include <X11/extensions/Xrandr.h>
+#include <X11/extensions/sync.h>    // IDLETIME alarms
+#include <X11/extensions/XShm.h>    // XShmPutImage()
 #include <X11/XKBlib.h> // XkbDescRec, XkbAllocKeyboard, XkbGetNames, XkbSymbolsNameMask, Atom
+#include <X11/Xlib-xcb.h>   // XGetXCBConnection()
+#include <xcb/xcb.h>
+#include <xcb/present.h>
+#include <xcb/randr.h>
+#include <xcb/xkb.h>
+#ifdef USE_XFT
+#include <X11/Xft/Xft.h>
+#endif
+#ifdef USE_XI
+#include <X11/extensions/XInput2.h>
+#endif
 #include <security/pam_appl.h>
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/socket.h> // socketpair()
+#include <sys/un.h>     // struct sockaddr_un
+#include <sys/stat.h>   // umask()
+#include <sys/ipc.h>
+#include <sys/shm.h>    // shmget()
+#include <limits.h>     // PATH_MAX
+#include <sys/wait.h>   // waitpid()
 #include <fcntl.h>
 #include <linux/vt.h>
 #include <time.h>
 
+#include "blur.h"
+#include "cache.h"
+#include "image.h"
+#include "logind.h"
+#include "prompt.h"
+#include "render.h"
+#include "secure.h"
+#include "stats.h"
+#include "status.h"
+#include "trace.h"
+
 #ifdef __GNUC__
     #define UNUSED(x) UNUSED_ ## x __attribute__((__unused__))
 #else
     #define UNUSED(x) UNUSED_ ## x
 #endif
 
+#ifndef MIN
+    #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+    #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
 #ifndef VERSION
     #define VERSION "develop"
 #endif
@@ -66,282 +108,3488 @@
 #endif
 
 
-/* used colors keys (for command-line) */
-/* looks stupid I know, but how the hell getopts_long works? */
-#define BACKGROUND_COLOR_KEY (1 << 8)
-#define TEXT_COLOR_KEY       ((1 << 8) + 1)
-#define ERRMSG_COLOR_KEY     ((1 << 8) + 2)
+/* used colors keys (for command-line) */
+/* looks stupid I know, but how the hell getopts_long works? */
+#define BACKGROUND_COLOR_KEY (1 << 8)
+#define TEXT_COLOR_KEY       ((1 << 8) + 1)
+#define ERRMSG_COLOR_KEY     ((1 << 8) + 2)
+#define RENDER_KEY           ((1 << 8) + 3)
+#define XFTFONT_KEY          ((1 << 8) + 4)
+#define STATS_KEY            ((1 << 8) + 5)
+#define GRAB_TIMEOUT_KEY     ((1 << 8) + 6)
+#define DAEMON_KEY           ((1 << 8) + 7)
+#define IDLE_LOCK_KEY        ((1 << 8) + 8)
+#define BACKGROUND_IMAGE_KEY ((1 << 8) + 9)
+#define BLUR_KEY             ((1 << 8) + 10)
+#define DPMS_KEY             ((1 << 8) + 11)
+#define TRACE_KEY            ((1 << 8) + 12)
+#define DISPLAY_KEY          ((1 << 8) + 13)
+#define XINPUT2_KEY          ((1 << 8) + 14)
+#define STATUS_KEY           ((1 << 8) + 15)
+#define LOGIND_KEY           ((1 << 8) + 16)
+
+/* default command-line argument values */
+#define DEF_FONT              "-xos4-terminus-bold-r-normal--16-*"
+#define DEF_PASSCHAR          "*"
+#define DEF_BACKGROUND_COLOR  "#C3BfB0"
+#define DEF_TEXT_COLOR        "#423638"
+#define DEF_ERRMSG_COLOR      "#F80009"
+#define DEF_GRAB_TIMEOUT      2000  /* ms */
+
+/* delays between grab attempts, doubled after every failure */
+#define GRAB_DELAY_MIN 1    /* ms */
+#define GRAB_DELAY_MAX 100  /* ms */
+
+/* frame pacing without Present, and the longest wait for a vblank (none
+ * arrives while the display is powered down) */
+#define FRAME_INTERVAL 16   /* ms */
+#define FRAME_TIMEOUT  100  /* ms */
+
+/* with --xinput2, keys of another device are ignored while the password
+ * typed on one was touched within this time */
+#define XI_SOURCE_TIMEOUT 3000  /* ms */
+
+/* inactivity until the display is powered down, in seconds, 0 for never */
+#define DEF_DIM_TIMEOUT     0
+#define DEF_STANDBY_TIMEOUT 0
+#define DEF_OFF_TIMEOUT     10
+
+/* delay of the power down asked for with Escape, so that its release does not wake the display */
+#define POWER_SETTLE 500  /* ms */
+
+typedef struct Dpms {
+    BOOL state;
+    CARD16 level;  // why?
+    CARD16 standby, suspend, off;
+} Dpms;
+
+/* maximum number of outputs with a lockscreen drawn on them */
+#define MAX_OUTPUTS 16
+
+/* maximum number of screens locked on one display, and of displays */
+#define MAX_SCREENS  8
+#define MAX_DISPLAYS 8
+
+/* geometry of one active CRTC */
+typedef struct OutputInfo {
+    RRCrtc crtc;        /* None when RandR reported nothing usable */
+    int x, y;
+    int width, height;
+} OutputInfo;
+
+typedef struct WindowPositionInfo {
+    int display_width, display_height;
+    int rr_event_base;  /* -1 without RandR */
+    int noutputs;
+    OutputInfo outputs[MAX_OUTPUTS];
+} WindowPositionInfo;
+
+/* number of strings whose width is measured once and then looked up */
+#define MAX_CACHED_RUNS 8
+
+/* the font text is drawn with, plus caches of text widths */
+typedef struct Typeface {
+    XFontStruct *core;          /* core X font, NULL when using Xft */
+#ifdef USE_XFT
+    XftFont *xft;
+    XftColor colors[2];         /* Xft colors for the pixels below */
+    unsigned long pixels[2];
+    int ncolors;
+#endif
+    int screen;
+    Bool borrowed;              /* core font of another screen, not freed */
+    int ascent, descent;
+    const char *mask;           /* passdisp, prefixes of it have known widths */
+    int mask_width[256];        /* width of every prefix of mask */
+    struct {
+        const char *text;       /* static string, compared by address */
+        int len, width;
+    } runs[MAX_CACHED_RUNS];
+    int nruns;
+} Typeface;
+
+/* how frames get onto the window */
+typedef enum RenderMode {
+    RENDER_DIRECT,      /* clear and draw on the window itself */
+    RENDER_PIXMAP,      /* draw into a back buffer, then copy damaged areas */
+} RenderMode;
+
+/* a canvas drawn with Xlib, see render.h */
+typedef struct X11Canvas {
+    Canvas canvas;
+    Window win;
+    Drawable target;    /* what widgets are painted on: win or back */
+    Pixmap back;        /* back buffer covering the output, None in direct mode */
+    int back_width, back_height;
+    GC gc;
+    GC clear_gc;        /* fills the back buffer with the background color */
+    Pixmap tile;        /* background image clear_gc fills with, None without */
+    Typeface *face;
+#ifdef USE_XFT
+    XftDraw *xftdraw;   /* Xft drawing on target, NULL with a core font */
+#endif
+    unsigned long foreground;   /* current GC foreground, saves XSetForeground calls */
+    unsigned long background;
+    Bool clone;         /* the output is a clone, see output_is_clone() */
+} X11Canvas;
+
+/* cached keyboard state, kept up to date by XKB events */
+typedef struct Keyboard {
+    int event_base;     /* XKB event type, -1 when XKB events are not available */
+    int group;          /* current layout group */
+    Bool caps;          /* caps lock indicator */
+    char *layout;       /* symbols name, e.g. "pc+us+ru:2+inet(evdev)" */
+    char *groups[XkbNumKbdGroups];  /* layout names, pointing into layout */
+    int ngroups;
+    Bool stale;         /* layout names changed, reread before they are shown */
+} Keyboard;
+
+/* colors given on the command line */
+enum {
+    COLOR_BACKGROUND,
+    COLOR_TEXT,
+    COLOR_ERRMSG,
+    COLOR_COUNT
+};
+
+static const char *color_names[COLOR_COUNT] = {
+    [COLOR_BACKGROUND] = "background color",
+    [COLOR_TEXT] = "text color",
+    [COLOR_ERRMSG] = "color for unauthenticated error message",
+};
+
+/* a color allocated at startup, in the colormap of one screen */
+typedef struct StartupColor {
+    const char *spec;   /* as given on the command line */
+    Bool named;         /* a color name the server has to look up */
+    XColor parsed;      /* the color otherwise */
+    xcb_alloc_color_cookie_t cookie;
+    xcb_alloc_named_color_cookie_t named_cookie;
+} StartupColor;
+
+/*
+ * Requests sent at startup. Everything which does not depend on another
+ * reply is sent at once and collected later, so startup costs about three
+ * round trips instead of one for every request, whatever the number of
+ * screens.
+ */
+typedef struct Startup {
+    xcb_connection_t *c;
+    int nscreens;
+    struct {
+        StartupColor colors[COLOR_COUNT];
+        xcb_randr_get_screen_resources_current_cookie_t resources;
+    } screens[MAX_SCREENS];
+    Bool have_randr;
+    Bool have_xkb;
+    Bool have_present;
+    xcb_get_font_path_cookie_t font_path;
+    Bool have_font_path;
+    uint64_t font_path_hash;
+    xcb_xkb_get_state_cookie_t xkb_state;
+    xcb_xkb_get_indicator_state_cookie_t xkb_indicators;
+    xcb_xkb_get_names_cookie_t xkb_names;
+} Startup;
+
+static int conv_callback(int num_msgs, const struct pam_message **msg, struct pam_response **resp, void *appdata_ptr);
+
+
+/* command-line arguments */
+static char* opt_font;
+static char* opt_xftfont;
+static char* opt_username;
+static char* opt_passchar;
+static char* opt_background_color;
+static char* opt_text_color;
+static char* opt_errmsg_color;
+static RenderMode opt_render;
+static char* opt_stats;
+static char* opt_trace;
+static char* opt_daemon;
+static char* opt_status;
+static char* opt_displays[MAX_DISPLAYS];
+static int   opt_ndisplays;
+static int   opt_grab_timeout;
+static int   opt_idle_lock;
+static Bool  opt_hidelength;
+static Bool  opt_usedpms;
+static Bool  opt_xinput2;
+static Bool  opt_logind;
+
+/* the connection requests go to, switched with display_use() */
+Display *dpy;
+
+/* set by SIGUSR1, statistics are dumped from the event loop */
+static volatile sig_atomic_t stats_requested;
+
+/* set by SIGUSR2, the trace is written from the event loop */
+static volatile sig_atomic_t trace_requested;
+
+/* set to the signal by SIGINT, SIGHUP and SIGTERM, csxlock cleans up and
+ * exits from the event loop */
+static volatile sig_atomic_t exit_requested;
+
+/* set by SIGRTMIN, a daemon locks */
+static volatile sig_atomic_t lock_requested;
+
+/* the signal handlers only set the flags above and write a byte here, which
+ * wakes whichever poll() is waiting */
+static int signal_pipe[2] = { -1, -1 };
+
+pam_handle_t *pam_handle;
+struct pam_conv conv = { conv_callback, NULL };
+
+/* what is typed and shown while locked, kept in the locked secure arena */
+typedef struct Secrets {
+    char password[256];         /* the password you enter */
+    char auth_password[256];    /* being authenticated, only used by the helper process */
+    char datetime[64];          /* formatted clock */
+    char text[256];             /* clock and keyboard layout line */
+} Secrets;
+
+static Secrets *secrets;
+
+/* a suspend held off by the logind inhibitor until the lock is painted */
+typedef struct Sleep {
+    Bool pending;
+    uint64_t since;     /* stats_now() of PrepareForSleep */
+} Sleep;
+
+static Sleep sleep_lock;
+
+/* texts of the status providers, see status.h */
+static int status_fd = -1;
+static char status_line[STATUS_MAX_PROVIDERS * (STATUS_TEXT + 3)];
+
+/* connection to the authentication helper process */
+typedef struct Auth {
+    int fd;             /* socket to the helper, -1 when not running */
+    pid_t pid;
+    Bool pending;       /* a password was sent, waiting for the verdict */
+    uint64_t submitted; /* stats_now() when the pending password was sent */
+    uint64_t traced;    /* TRACE_START() of the pending authentication */
+} Auth;
+
+static Auth auth = { .fd = -1, .pid = -1, .pending = False };
+
+/* control socket of the daemon mode */
+typedef struct Control {
+    int fd;             /* listening socket, -1 when not running as a daemon */
+    struct sockaddr_un addr;
+    int client;         /* accepted, its command not read yet, -1 when none */
+} Control;
+
+static Control control = { .fd = -1, .client = -1 };
+
+/* alarms on the server's IDLETIME counter, for locking on inactivity */
+typedef struct Idle {
+    int event_base;     /* XSync event base, -1 when not locking on inactivity */
+    XSyncValue timeout; /* ms */
+    XSyncAlarm idle;    /* inactive for timeout, disarmed after it fired */
+    XSyncAlarm reset;   /* input after being inactive for timeout */
+} Idle;
+
+#ifdef USE_XI
+/* the XInput 2 input path of --xinput2 */
+typedef struct Xi {
+    int opcode;         /* of the extension, -1 when the core input path is used */
+    int pointer;        /* master devices, grabbed instead of the core ones */
+    int keyboard;
+    Window root;
+    Bool motion;        /* raw motion selected */
+    uint64_t rearm;     /* monotonic_ms() when it is selected again, 0 for not */
+    int source;         /* slave device the password is typed on */
+    Time source_time;   /* of its last key */
+} Xi;
+#endif
+
+/* state of the pointer and keyboard grabs */
+typedef struct Grab {
+    Window root;        /* grab window */
+    Window win;         /* lock window, raised when obscured */
+    Cursor cursor;
+    Bool pointer;       /* held */
+    Bool keyboard;      /* held */
+    int delay;          /* ms until the next attempt */
+    uint64_t next_try;  /* monotonic_ms() of the next attempt */
+#ifdef USE_XI
+    Xi *xi;             /* grabs through XInput 2 when it is in use */
+#endif
+} Grab;
+
+/* at most one frame per vblank, reported by Present or estimated by a timer */
+typedef struct Pacer {
+    xcb_connection_t *c;
+    xcb_special_event_t *special;   /* Present events, NULL when the timer paces */
+    uint32_t stamp;
+    Window win;
+    uint32_t serial;                /* of the last vblank notification asked for */
+    Bool waiting;                   /* a frame was sent, the next one waits */
+    uint64_t next_frame;            /* monotonic_ms() when it is sent regardless */
+} Pacer;
+
+/* background image, shared by every screen */
+typedef struct Wallpaper {
+    const char *path;   /* NULL without a background image */
+    int blur;           /* blur radius of a desktop screenshot, 0 without */
+    Image image;        /* mapped when first needed, cached scalings skip it */
+    Bool opened;
+} Wallpaper;
+
+static Wallpaper wallpaper = { .path = NULL, .blur = 0, .opened = False };
+
+/* the background of one screen, scaled per output into a pixmap the server repaints from */
+typedef struct Backdrop {
+    Pixmap pixmap;      /* covers the screen, the window's background */
+    int width, height;
+    GC gc;
+} Backdrop;
+
+/* display power while locked, deeper states follow each other */
+typedef enum PowerState {
+    POWER_ACTIVE,
+    POWER_DIMMED,       /* lock window blanked */
+    POWER_STANDBY,      /* DPMS standby */
+    POWER_OFF,          /* DPMS off */
+    POWER_STATE_COUNT,
+} PowerState;
+
+typedef struct Power {
+    PowerState state;
+    int timeouts[POWER_STATE_COUNT];    /* s of inactivity until a state, 0 for never */
+    uint64_t last_input;                /* monotonic_ms() */
+    PowerState requested;               /* entered at requested_at regardless of input */
+    uint64_t requested_at;
+    Bool dpms;                          /* DPMS is handled on some display */
+} Power;
+
+static Power power = {
+    .state = POWER_ACTIVE,
+    .timeouts = { 0, DEF_DIM_TIMEOUT, DEF_STANDBY_TIMEOUT, DEF_OFF_TIMEOUT },
+    .requested = POWER_ACTIVE,
+};
+
+typedef struct LockDisplay LockDisplay;
+
+/* one screen of a display: its lock window and everything drawn on it */
+typedef struct LockScreen {
+    LockDisplay *display;
+    int num;
+    Window root, win;
+    Cursor cursor;
+    GC gc;
+    Typeface face;
+    XColor background, text_color, errmsg_color;
+    WindowPositionInfo info;
+    X11Canvas canvases[MAX_OUTPUTS];
+    Backdrop backdrop;
+    Pacer pacer;
+} LockScreen;
+
+/*
+ * One X connection, every screen of it is locked. The keyboard and the
+ * pointer belong to the display, they are grabbed on the first screen.
+ */
+struct LockDisplay {
+    const char *name;       /* as given with --display, NULL for $DISPLAY */
+    Display *dpy;
+    Keyboard keyboard;
+    Grab grab;
+    Idle idle;
+#ifdef USE_XI
+    Xi xi;
+#endif
+    Dpms dpms_original;     /* restored when unlocking */
+    Bool using_dpms;
+    int shm;                /* MIT-SHM: -1 untested, 0 unusable, 1 works */
+    int nscreens;
+    LockScreen *screens;
+};
+
+/* need globals for signal handling */
+static LockDisplay displays[MAX_DISPLAYS];
+static int ndisplays;
+
+
+static void
+die(const char *errstr, ...) {
+    va_list ap;
+    va_start(ap, errstr);
+    fprintf(stderr, "%s: ", PROGNAME);
+    vfprintf(stderr, errstr, ap);
+    va_end(ap);
+    trace_dump();
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Callback function for PAM, runs in the helper process. We only react on
+ * password request callbacks.
+ *
+ */
+static int
+conv_callback(int num_msgs, const struct pam_message **msg, struct pam_response **resp, void *UNUSED(appdata_ptr)) {
+    if (num_msgs == 0)
+        return PAM_BUF_ERR;
+
+    // PAM expects an array of responses, one for each message, and frees
+    // them itself, so they can not come from the secure arena
+    struct pam_response *responses = calloc(num_msgs, sizeof(struct pam_response));
+    if (responses == NULL)
+        return PAM_BUF_ERR;
+
+    size_t size = strlen(secrets->auth_password) + 1;
+    for (int i = 0; i < num_msgs; i++) {
+        if (msg[i]->msg_style != PAM_PROMPT_ECHO_OFF &&
+            msg[i]->msg_style != PAM_PROMPT_ECHO_ON)
+            continue;
+
+        // return code is currently not used but should be set to zero
+        responses[i].resp_retcode = 0;
+        if ((responses[i].resp = malloc(size)) == NULL) {
+            for (int j = 0; j < i; j++)
+                if (responses[j].resp) {
+                    secure_clear(responses[j].resp, size);
+                    free(responses[j].resp);
+                }
+            free(responses);
+            return PAM_BUF_ERR;
+        }
+        memcpy(responses[i].resp, secrets->auth_password, size);
+    }
+    *resp = responses;
+
+    return PAM_SUCCESS;
+}
+
+/*
+ * Main function of the authentication helper process. It starts PAM, reports
+ * the result and then answers every password it receives with the return
+ * value of pam_authenticate(). Exits when the UI closes its end of the socket.
+ *
+ */
+static void
+auth_helper(int fd, const char *username) {
+    int ret;
+
+    /* memory locks are not inherited over fork() */
+    if (secure_lock() != 0) {
+        fprintf(stderr, "%s: could not lock page in memory, check RLIMIT_MEMLOCK\n", PROGNAME);
+        ret = PAM_BUF_ERR;
+        write(fd, &ret, sizeof(ret));
+        _exit(EXIT_FAILURE);
+    }
+
+#ifdef PAM_CONFDIR
+    /* benchmark builds read their PAM stack from a private directory */
+    ret = pam_start_confdir("csxlock", username, &conv, PAM_CONFDIR, &pam_handle);
+#else
+    ret = pam_start("csxlock", username, &conv, &pam_handle);
+#endif
+    if (ret != PAM_SUCCESS)
+        fprintf(stderr, "%s: PAM: %s\n", PROGNAME, pam_strerror(pam_handle, ret));
+    if (write(fd, &ret, sizeof(ret)) != sizeof(ret) || ret != PAM_SUCCESS)
+        _exit(EXIT_FAILURE);
+
+    for (;;) {
+        ssize_t n = recv(fd, secrets->auth_password, sizeof(secrets->auth_password), 0);
+        if (n <= 0)
+            break;
+        secrets->auth_password[sizeof(secrets->auth_password) - 1] = '\0';
+
+        ret = pam_authenticate(pam_handle, 0);
+        secure_clear(secrets->auth_password, sizeof(secrets->auth_password));
+
+        if (write(fd, &ret, sizeof(ret)) != sizeof(ret))
+            break;
+    }
+
+    pam_end(pam_handle, ret);
+    _exit(EXIT_SUCCESS);
+}
+
+/*
+ * Forks the authentication helper. Its first message is the result of
+ * pam_start(), read by auth_wait_ready().
+ *
+ */
+static void
+auth_spawn(const char *username) {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+        die("socketpair: %s\n", strerror(errno));
+
+    switch (auth.pid = fork()) {
+        case -1:
+            die("fork: %s\n", strerror(errno));
+        case 0:
+            /* never touch the X connection or the parent's handlers: the
+             * others write to the signal pipe, closed below, whose number
+             * PAM may reuse, and pkill -USR1 csxlock reaches the helper too */
+            signal(SIGINT, SIG_DFL);
+            signal(SIGHUP, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGUSR1, SIG_IGN);
+            signal(SIGUSR2, SIG_IGN);
+            signal(SIGRTMIN, SIG_IGN);
+            for (int i = 0; i < ndisplays; i++)
+                close(ConnectionNumber(displays[i].dpy));
+            if (control.fd != -1)
+                close(control.fd);
+            if (control.client != -1)
+                close(control.client);
+            close(signal_pipe[0]);
+            close(signal_pipe[1]);
+            logind_forked();
+            trace_disable();
+            close(sv[0]);
+            auth_helper(sv[1], username);
+    }
+
+    close(sv[1]);
+    auth.fd = sv[0];
+    auth.pending = False;
+}
+
+/*
+ * Stops the helper and reaps it. Closing the socket makes it exit.
+ *
+ */
+static void
+auth_close(void) {
+    if (auth.fd != -1)
+        close(auth.fd);
+    if (auth.pid > 0)
+        waitpid(auth.pid, NULL, 0);
+    auth.fd = -1;
+    auth.pid = -1;
+    auth.pending = False;
+}
+
+/*
+ * Blocks until the helper reports that PAM is set up. Returns the pam_start()
+ * result, or PAM_SYSTEM_ERR when the helper died.
+ *
+ */
+static int
+auth_wait_ready(void) {
+    int ret;
+    ssize_t n;
+
+    while ((n = read(auth.fd, &ret, sizeof(ret))) == -1 && errno == EINTR)
+        ;
+    if (n != sizeof(ret))
+        return PAM_SYSTEM_ERR;
+    return ret;
+}
+
+/*
+ * Waits for the helper at startup, there is nothing to lock with without PAM.
+ *
+ */
+static void
+auth_ready(void) {
+    uint64_t trace = TRACE_START();
+    int ret = auth_wait_ready();
+    TRACE_SPAN("pam_start", trace, ret);
+    if (ret != PAM_SUCCESS)
+        die("PAM: authentication helper failed to start\n");
+    stats_mark(STATS_PAM_READY);
+}
+
+/*
+ * Hands a password over to the helper, the verdict arrives on auth.fd.
+ * A helper which died in the meantime is restarted first.
+ *
+ */
+static Bool
+auth_submit(const char *pass, unsigned int len, const char *username) {
+    if (auth.fd == -1) {
+        auth_spawn(username);
+        if (auth_wait_ready() != PAM_SUCCESS) {
+            auth_close();
+            return False;
+        }
+    }
+
+    /* send the terminating NUL too, an empty message would look like EOF */
+    if (send(auth.fd, pass, len + 1, MSG_NOSIGNAL) != (ssize_t)(len + 1)) {
+        auth_close();
+        return False;
+    }
+
+    auth.pending = True;
+    if (stats_enabled)
+        auth.submitted = stats_now();
+    auth.traced = TRACE_START();
+    return True;
+}
+
+/*
+ * Reads the verdict of a pending authentication. A helper which died counts
+ * as a failed attempt and is restarted on the next submit.
+ *
+ */
+static int
+auth_read_verdict(void) {
+    int ret;
+    ssize_t n = recv(auth.fd, &ret, sizeof(ret), 0);
+
+    if (n == -1 && (errno == EINTR || errno == EAGAIN))
+        return -1;
+
+    auth.pending = False;
+    if (stats_enabled)
+        stats_record(STATS_AUTH, stats_now() - auth.submitted);
+    if (n != sizeof(ret)) {
+        auth_close();
+        ret = PAM_SYSTEM_ERR;
+    }
+    TRACE_SPAN("pam_authenticate", auth.traced, ret);
+    return ret;
+}
+
+/*
+ * Wakes the event loop from a signal handler. Nothing else is done in the
+ * handlers: Xlib, stdio and the allocator are not async-signal-safe.
+ *
+ */
+static void
+signal_wake(void) {
+    int saved = errno;
+    write(signal_pipe[1], "", 1);
+    errno = saved;
+}
+
+void
+handle_signal(int sig) {
+    exit_requested = sig;
+    signal_wake();
+}
+
+void
+handle_stats_signal(int UNUSED(sig)) {
+    stats_requested = 1;
+    signal_wake();
+}
+
+void
+handle_trace_signal(int UNUSED(sig)) {
+    trace_requested = 1;
+    signal_wake();
+}
+
+void
+handle_lock_signal(int UNUSED(sig)) {
+    lock_requested = 1;
+    signal_wake();
+}
+
+static void
+signals_open(void) {
+    if (pipe(signal_pipe) == -1)
+        die("pipe: %s\n", strerror(errno));
+    for (int i = 0; i < 2; i++) {
+        fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+}
+
+/*
+ * Does what the signal handlers asked for, from the event loop. Exiting is
+ * left to the caller, which checks exit_requested: the DPMS settings, the
+ * secure arena and the statistics are taken care of on the way out of main.
+ *
+ */
+static void
+signals_run(void) {
+    char buf[16];
+
+    while (read(signal_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+    if (stats_requested) {
+        stats_requested = 0;
+        stats_dump();
+    }
+    if (trace_requested) {
+        trace_requested = 0;
+        trace_dump();
+    }
+}
+
+/*
+ * csxlock may be installed SUID root for the console lock. Files and sockets
+ * named by the user are handled with the user's identity in between these.
+ *
+ */
+static uid_t saved_euid;
+
+static void
+privileges_drop(void) {
+    saved_euid = geteuid();
+    if (setreuid(-1, getuid()) == -1)
+        die("setreuid: %s\n", strerror(errno));
+}
+
+static void
+privileges_restore(void) {
+    if (setreuid(-1, saved_euid) == -1)
+        die("setreuid: %s\n", strerror(errno));
+}
+
+/*
+ * Makes a display the one requests go to. Code working on a single
+ * connection uses the global dpy, it is switched between displays here.
+ *
+ */
+static void
+display_use(LockDisplay *d) {
+    dpy = d->dpy;
+}
+
+/*
+ * Opens the control socket of the daemon mode. Only the user may connect,
+ * a socket left behind by a daemon which died is replaced.
+ *
+ */
+static void
+control_open(const char *path) {
+    control.addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(control.addr.sun_path))
+        die("socket path too long: %s\n", path);
+    strcpy(control.addr.sun_path, path);
+
+    privileges_drop();
+
+    if ((control.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        die("socket: %s\n", strerror(errno));
+
+    /* someone is answering, do not steal their socket */
+    if (connect(control.fd, (struct sockaddr *)&control.addr, sizeof(control.addr)) == 0)
+        die("already running on %s\n", path);
+    close(control.fd);
+    unlink(path);
+
+    if ((control.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        die("socket: %s\n", strerror(errno));
+    mode_t mask = umask(0077);
+    if (bind(control.fd, (struct sockaddr *)&control.addr, sizeof(control.addr)) == -1)
+        die("bind %s: %s\n", path, strerror(errno));
+    umask(mask);
+    if (listen(control.fd, 4) == -1)
+        die("listen: %s\n", strerror(errno));
+
+    privileges_restore();
+}
+
+static void
+control_close(void) {
+    if (control.fd == -1)
+        return;
+    close(control.fd);
+    if (control.client != -1)
+        close(control.client);
+    control.client = -1;
+    privileges_drop();
+    unlink(control.addr.sun_path);
+    privileges_restore();
+    control.fd = -1;
+}
+
+/*
+ * Fills three poll() entries: the control socket and the client whose
+ * command is awaited, ignored by poll() when not running as a daemon, and
+ * the signal pipe. Refilled before every poll(), the client comes and goes.
+ *
+ */
+static void
+control_fds(struct pollfd fds[3]) {
+    fds[0].fd = control.fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = signal_pipe[0];
+    fds[1].events = POLLIN;
+    fds[2].fd = control.client;
+    fds[2].events = POLLIN;
+}
+
+/*
+ * Answers a client and hangs up.
+ *
+ */
+static void
+control_reply(int client, const char *msg) {
+    if (client == -1)
+        return;
+    send(client, msg, strlen(msg), MSG_NOSIGNAL);
+    close(client);
+}
+
+/*
+ * Checks the control fds filled by control_fds() after poll() and
+ * signals_run(). Returns True when a lock was asked for, by the signal
+ * (*client is -1) or by a "lock" command on the socket (*client is the
+ * connection waiting for the answer). Never waits for a client: one whose
+ * command has not arrived yet is polled with everything else.
+ *
+ */
+static Bool
+control_lock_requested(struct pollfd fds[3], int *client) {
+    char buf[16];
+    Bool readable = control.client != -1 && (fds[2].revents & (POLLIN | POLLHUP | POLLERR));
+
+    *client = -1;
+
+    if (lock_requested) {
+        lock_requested = 0;
+        return True;
+    }
+
+    /* a waiting command goes first, the next client is still queued */
+    if (!readable && (fds[0].revents & POLLIN)) {
+        int fd = accept(control.fd, NULL, NULL);
+        if (fd != -1) {
+            /* a client which does not say anything only holds its place
+             * until the next one connects */
+            control_reply(control.client, "error: no command\n");
+            control.client = fd;
+            readable = True;
+        }
+    }
+    if (!readable)
+        return False;
+
+    ssize_t n = recv(control.client, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return False;
+    buf[n > 0 ? n : 0] = '\0';
+    buf[strcspn(buf, "\r\n")] = '\0';
+    *client = control.client;
+    control.client = -1;
+
+    if (strcmp(buf, "lock") == 0)
+        return True;
+
+    control_reply(*client, "error: unknown command\n");
+    *client = -1;
+    return False;
+}
+
+/*
+ * Returns the width of a string in pixels. Prefixes of the password mask and
+ * static strings registered with typeface_cache_run() are a table lookup,
+ * everything else is measured.
+ *
+ */
+static int
+typeface_width(Typeface *face, const char *text, int len) {
+    if (len == 0)
+        return 0;
+    if (text == face->mask && len < (int)(sizeof(face->mask_width) / sizeof(face->mask_width[0])))
+        return face->mask_width[len];
+    for (int i = 0; i < face->nruns; i++)
+        if (face->runs[i].text == text && face->runs[i].len == len)
+            return face->runs[i].width;
+
+#ifdef USE_XFT
+    if (face->xft) {
+        XGlyphInfo extents;
+        XftTextExtentsUtf8(dpy, face->xft, (const FcChar8 *)text, len, &extents);
+        return extents.xOff;
+    }
+#endif
+    return XTextWidth(face->core, text, len);
+}
+
+/*
+ * Measures a string which never changes once, later widths are looked up.
+ *
+ */
+static void
+typeface_cache_run(Typeface *face, const char *text, int len) {
+    if (face->nruns == MAX_CACHED_RUNS)
+        return;
+    int width = typeface_width(face, text, len);
+    face->runs[face->nruns].text = text;
+    face->runs[face->nruns].len = len;
+    face->runs[face->nruns].width = width;
+    face->nruns++;
+}
+
+/*
+ * Measures every prefix of the password mask, so centering the mask costs a
+ * single table lookup per keystroke.
+ *
+ */
+static void
+typeface_cache_mask(Typeface *face, const char *mask, int size) {
+    face->mask = NULL;
+    for (int len = 0; len < size && len < (int)(sizeof(face->mask_width) / sizeof(face->mask_width[0])); len++)
+        face->mask_width[len] = typeface_width(face, mask, len);
+    face->mask = mask;
+}
+
+/*
+ * Loads the Xft font when a pattern is given, the core font otherwise.
+ * With Xft the glyphs are uploaded to a server-side GlyphSet the first
+ * time they are drawn and reused afterwards.
+ *
+ */
+static Bool
+typeface_load(Typeface *face, int screen, const char *core_name, const char *xft_name) {
+    memset(face, 0, sizeof(*face));
+    face->screen = screen;
+
+#ifdef USE_XFT
+    if (xft_name) {
+        if (!(face->xft = XftFontOpenName(dpy, screen, xft_name)))
+            return False;
+        face->ascent = face->xft->ascent;
+        face->descent = face->xft->descent;
+        return True;
+    }
+#else
+    if (xft_name)
+        fprintf(stderr, "Warning: built without Xft, ignoring --xftfont.\n");
+#endif
+
+    if (!(face->core = XLoadQueryFont(dpy, core_name)))
+        return False;
+    face->ascent = face->core->ascent;
+    face->descent = face->core->descent;
+    return True;
+}
+
+/*
+ * The full XLFD the server matched a core font pattern to, empty for Xft.
+ *
+ */
+static void
+typeface_resolved_name(const Typeface *face, char *buf, size_t size) {
+    unsigned long atom;
+    char *name;
+
+    buf[0] = '\0';
+    if (!face->core || !XGetFontProperty(face->core, XA_FONT, &atom))
+        return;
+    if ((name = XGetAtomName(dpy, atom))) {
+        if (strlen(name) < size && !strchr(name, '\n'))
+            strcpy(buf, name);
+        XFree(name);
+    }
+}
+
+/*
+ * Makes a color usable for text. Core fonts draw with the GC foreground,
+ * only Xft needs its own color.
+ *
+ */
+static void
+typeface_add_color(Typeface *face, XColor *color) {
+#ifdef USE_XFT
+    if (face->xft && face->ncolors < 2) {
+        XRenderColor render = { color->red, color->green, color->blue, 0xffff };
+        XftColorAllocValue(dpy, DefaultVisual(dpy, face->screen),
+                DefaultColormap(dpy, face->screen), &render, &face->colors[face->ncolors]);
+        face->pixels[face->ncolors++] = color->pixel;
+    }
+#else
+    (void)face;
+    (void)color;
+#endif
+}
+
+static void
+typeface_free(Typeface *face) {
+#ifdef USE_XFT
+    if (face->xft) {
+        for (int i = 0; i < face->ncolors; i++)
+            XftColorFree(dpy, DefaultVisual(dpy, face->screen),
+                    DefaultColormap(dpy, face->screen), &face->colors[i]);
+        XftFontClose(dpy, face->xft);
+    }
+#endif
+    if (face->core && !face->borrowed)
+        XFreeFont(dpy, face->core);
+}
+
+/*
+ * Drawing goes to the back buffer at the output's position, or straight to
+ * the window.
+ *
+ */
+static int
+x11_origin_x(const X11Canvas *x11) {
+    return x11->back != None ? x11->canvas.area.x : 0;
+}
+
+static int
+x11_origin_y(const X11Canvas *x11) {
+    return x11->back != None ? x11->canvas.area.y : 0;
+}
+
+static void
+x11_set_foreground(X11Canvas *x11, unsigned long color) {
+    if (x11->foreground != color) {
+        XSetForeground(dpy, x11->gc, color);
+        x11->foreground = color;
+    }
+}
+
+static int
+x11_text_width(Canvas *canvas, const char *text, int len) {
+    return typeface_width(((X11Canvas *)canvas)->face, text, len);
+}
+
+/*
+ * Fills a window area with the background: XClearArea on the window, or a
+ * fill of the back buffer.
+ *
+ */
+static void
+x11_clear(Canvas *canvas, int x, int y, int width, int height) {
+    X11Canvas *x11 = (X11Canvas *)canvas;
+
+    if (x11->back == None)
+        XClearArea(dpy, x11->win, x, y, width, height, False);
+    else
+        XFillRectangle(dpy, x11->back, x11->clear_gc,
+                x - x11_origin_x(x11), y - x11_origin_y(x11), width, height);
+}
+
+/*
+ * Draws a string with its baseline at the given window position, through
+ * Xft or with the core font of the GC.
+ *
+ */
+static void
+x11_text(Canvas *canvas, int x, int y, unsigned long color, const char *text, int len) {
+    X11Canvas *x11 = (X11Canvas *)canvas;
+
+    x -= x11_origin_x(x11);
+    y -= x11_origin_y(x11);
+
+#ifdef USE_XFT
+    if (x11->xftdraw) {
+        Typeface *face = x11->face;
+        int c = 0;
+        while (c < face->ncolors - 1 && face->pixels[c] != color)
+            c++;
+        XftDrawStringUtf8(x11->xftdraw, &face->colors[c], face->xft, x, y,
+                (const FcChar8 *)text, len);
+        return;
+    }
+#endif
+
+    x11_set_foreground(x11, color);
+    XDrawString(dpy, x11->target, x11->gc, x, y, text, len);
+}
+
+static void
+x11_line(Canvas *canvas, int x1, int y1, int x2, int y2, unsigned long color) {
+    X11Canvas *x11 = (X11Canvas *)canvas;
+    int ox = x11_origin_x(x11), oy = x11_origin_y(x11);
+
+    x11_set_foreground(x11, color);
+    XDrawLine(dpy, x11->target, x11->gc, x1 - ox, y1 - oy, x2 - ox, y2 - oy);
+}
+
+/*
+ * Copies the damaged areas of the back buffer onto the window.
+ *
+ */
+static void
+x11_flush(Canvas *canvas, const RenderRect *damage, int ndamage) {
+    X11Canvas *x11 = (X11Canvas *)canvas;
+    int ox = x11_origin_x(x11), oy = x11_origin_y(x11);
+
+    for (int i = 0; i < ndamage; i++) {
+        const RenderRect *r = &damage[i];
+        XCopyArea(dpy, x11->back, x11->win, x11->gc,
+                r->x - ox, r->y - oy, r->width, r->height, r->x, r->y);
+    }
+}
+
+/*
+ * Points the Xft drawing at the current target of the canvas.
+ *
+ */
+static void
+x11_set_target(X11Canvas *x11, Drawable target) {
+    x11->target = target;
+#ifdef USE_XFT
+    if (x11->xftdraw) {
+        XftDrawDestroy(x11->xftdraw);
+        x11->xftdraw = NULL;
+    }
+    if (x11->face && x11->face->xft)
+        x11->xftdraw = XftDrawCreate(dpy, target, DefaultVisual(dpy, x11->face->screen),
+                DefaultColormap(dpy, x11->face->screen));
+#endif
+}
+
+/*
+ * Creates the back buffer for pixmap mode, covering the given window area.
+ *
+ */
+static void
+x11_create_back(X11Canvas *x11, const RenderRect *area) {
+    XGCValues values;
+
+    x11->back_width = area->width;
+    x11->back_height = area->height;
+    x11->back = XCreatePixmap(dpy, x11->win, area->width, area->height,
+            DefaultDepth(dpy, x11->face->screen));
+    x11_set_target(x11, x11->back);
+
+    values.foreground = x11->background;
+    values.graphics_exposures = False;
+    x11->clear_gc = XCreateGC(dpy, x11->back, GCForeground | GCGraphicsExposures, &values);
+
+    /* clearing shows the background image, tiled from its display position */
+    if (x11->tile != None) {
+        XSetTile(dpy, x11->clear_gc, x11->tile);
+        XSetFillStyle(dpy, x11->clear_gc, FillTiled);
+        XSetTSOrigin(dpy, x11->clear_gc, -area->x, -area->y);
+    }
+}
+
+static void
+x11_free_back(X11Canvas *x11) {
+    if (x11->back != None) {
+        XFreeGC(dpy, x11->clear_gc);
+        XFreePixmap(dpy, x11->back);
+    }
+    x11->back = None;
+    x11_set_target(x11, x11->win);
+}
+
+/*
+ * In pixmap mode, a back buffer is only recreated when the size changed.
+ *
+ */
+static void
+x11_place(Canvas *canvas, const RenderRect *area) {
+    X11Canvas *x11 = (X11Canvas *)canvas;
+
+    if (!canvas->buffered)
+        return;
+    if (x11->back != None && (x11->back_width != area->width || x11->back_height != area->height))
+        x11_free_back(x11);
+    if (x11->back == None)
+        x11_create_back(x11, area);
+    else if (x11->tile != None)
+        XSetTSOrigin(dpy, x11->clear_gc, -area->x, -area->y);
+}
+
+static const RenderBackend x11_backend = {
+    .text_width = x11_text_width,
+    .place = x11_place,
+    .clear = x11_clear,
+    .text = x11_text,
+    .line = x11_line,
+    .flush = x11_flush,
+};
+
+static void
+x11_canvas_free(X11Canvas *x11) {
+    x11_free_back(x11);
+#ifdef USE_XFT
+    if (x11->xftdraw)
+        XftDrawDestroy(x11->xftdraw);
+    x11->xftdraw = NULL;
+#endif
+}
+
+/*
+ * Lays a canvas out on an output, see canvas_layout().
+ *
+ */
+static void
+x11_canvas_layout(X11Canvas *x11, const OutputInfo *output) {
+    RenderRect area = { output->x, output->y, output->width, output->height };
+    canvas_layout(&x11->canvas, &area);
+}
+
+/*
+ * A CRTC showing the same area as an earlier one (clone mode) gets no
+ * canvas of its own, the earlier one paints it already.
+ *
+ */
+static Bool
+output_is_clone(const WindowPositionInfo *info, int n) {
+    const OutputInfo *o = &info->outputs[n];
+    for (int i = 0; i < n; i++) {
+        const OutputInfo *p = &info->outputs[i];
+        if (p->x == o->x && p->y == o->y && p->width == o->width && p->height == o->height)
+            return True;
+    }
+    return False;
+}
+
+/*
+ * Lays out the canvas of output n, unless it is a clone: display_render()
+ * skips those, so they keep no back buffer.
+ *
+ */
+static void
+output_layout(LockScreen *s, int n) {
+    X11Canvas *x11 = &s->canvases[n];
+
+    x11->clone = output_is_clone(&s->info, n);
+    if (x11->clone)
+        x11_free_back(x11);
+    else
+        x11_canvas_layout(x11, &s->info.outputs[n]);
+}
+
+static Bool shm_failed;
+
+static int
+shm_error_handler(Display *UNUSED(display), XErrorEvent *UNUSED(event)) {
+    shm_failed = True;
+    return 0;
+}
+
+/*
+ * Creates an image for exchanging pixels with the server, in shared memory
+ * when the server can attach it (it is local), otherwise in client memory.
+ * With pixels, a client side image uses them in place.
+ *
+ */
+static XImage *
+upload_create(LockScreen *s, XShmSegmentInfo *shm, int width, int height, const uint32_t *pixels) {
+    Visual *visual = DefaultVisual(dpy, s->num);
+    int depth = DefaultDepth(dpy, s->num);
+    XImage *ximage;
+
+    shm->shmaddr = NULL;
+    if (s->display->shm && XShmQueryExtension(dpy) &&
+            (ximage = XShmCreateImage(dpy, visual, depth, ZPixmap, NULL, shm, width, height))) {
+        shm->shmid = shmget(IPC_PRIVATE, (size_t)ximage->bytes_per_line * height, IPC_CREAT | 0600);
+        if (shm->shmid != -1) {
+            shm->shmaddr = ximage->data = shmat(shm->shmid, NULL, 0);
+            shm->readOnly = False;
+            /* the segment goes away with its last user */
+            shmctl(shm->shmid, IPC_RMID, NULL);
+            if (shm->shmaddr != (char *)-1) {
+                /* attaching fails asynchronously for remote servers */
+                XErrorHandler handler = XSetErrorHandler(shm_error_handler);
+                shm_failed = False;
+                XShmAttach(dpy, shm);
+                XSync(dpy, False);
+                XSetErrorHandler(handler);
+                s->display->shm = !shm_failed;
+                if (s->display->shm) {
+                    if (pixels)
+                        for (int y = 0; y < height; y++)
+                            memcpy(ximage->data + y * ximage->bytes_per_line, pixels + (size_t)y * width,
+                                    width * sizeof(uint32_t));
+                    return ximage;
+                }
+                shmdt(shm->shmaddr);
+            }
+        }
+        shm->shmaddr = NULL;
+        ximage->data = NULL;
+        XDestroyImage(ximage);
+    }
+    s->display->shm = 0;
+
+    char *data = pixels ? (char *)pixels : malloc((size_t)width * height * sizeof(uint32_t));
+    if (data == NULL)
+        return NULL;
+    ximage = XCreateImage(dpy, visual, depth, ZPixmap, 0, data, width, height, 32,
+            width * sizeof(uint32_t));
+    if (ximage == NULL) {
+        if (!pixels)
+            free(data);
+        return NULL;
+    }
+    /* pixels are stored in host order, Xlib converts them when needed */
+    uint32_t one = 1;
+    ximage->byte_order = *(char *)&one ? LSBFirst : MSBFirst;
+    return ximage;
+}
+
+/*
+ * Copies the image into the background pixmap and frees it. Pixels passed
+ * to upload_create() stay with the caller.
+ *
+ */
+static void
+upload_put(LockScreen *s, XShmSegmentInfo *shm, XImage *ximage, int x, int y, Bool borrowed) {
+    if (shm->shmaddr) {
+        XShmPutImage(dpy, s->backdrop.pixmap, s->backdrop.gc, ximage, 0, 0, x, y,
+                ximage->width, ximage->height, False);
+        /* the server must be done reading before the segment goes */
+        XSync(dpy, False);
+        XShmDetach(dpy, shm);
+        shmdt(shm->shmaddr);
+        ximage->data = NULL;
+    } else {
+        XPutImage(dpy, s->backdrop.pixmap, s->backdrop.gc, ximage, 0, 0, x, y,
+                ximage->width, ximage->height);
+        if (borrowed)
+            ximage->data = NULL;
+    }
+    XDestroyImage(ximage);
+}
+
+/*
+ * Paints the background image scaled to one output. A scaling cached by an
+ * earlier run is used as it is, otherwise the image is scaled straight into
+ * the upload buffer and the result is cached.
+ *
+ */
+static void
+wallpaper_paint_output(LockScreen *s, const OutputInfo *output) {
+    char cache[PATH_MAX];
+    const uint32_t *cached = NULL;
+    size_t map_size = 0;
+    Bool cacheable;
+    XShmSegmentInfo shm;
+    XImage *ximage;
+
+    if (wallpaper.path == NULL)
+        return;
+
+    privileges_drop();
+    cacheable = image_cache_path(cache, sizeof(cache), wallpaper.path, output->width, output->height) == 0;
+    if (cacheable)
+        cached = image_cache_map(cache, output->width, output->height, &map_size);
+    if (!cached && !wallpaper.opened) {
+        const char *error = image_open(&wallpaper.image, wallpaper.path);
+        if (error) {
+            fprintf(stderr, "Warning: can not load %s: %s.\n", wallpaper.path, error);
+            wallpaper.path = NULL;
+            privileges_restore();
+            return;
+        }
+        wallpaper.opened = True;
+    }
+    privileges_restore();
+
+    if ((ximage = upload_create(s, &shm, output->width, output->height, cached)) == NULL) {
+        if (cached)
+            image_cache_unmap(cached, map_size);
+        return;
+    }
+
+    if (!cached) {
+        size_t stride = ximage->bytes_per_line / sizeof(uint32_t);
+        image_scale(&wallpaper.image, output->width, output->height, (uint32_t *)ximage->data, stride);
+        if (cacheable) {
+            privileges_drop();
+            image_cache_store(cache, output->width, output->height, (uint32_t *)ximage->data, stride);
+            privileges_restore();
+        }
+    }
+
+    upload_put(s, &shm, ximage, output->x, output->y, cached != NULL);
+    if (cached)
+        image_cache_unmap(cached, map_size);
+}
+
+/*
+ * (Re)creates the background pixmap of a screen for its current size and
+ * paints every output. Only 24 bit TrueColor visuals with 8 bits per channel
+ * are supported.
+ *
+ */
+static void
+wallpaper_create(LockScreen *s) {
+    const WindowPositionInfo *info = &s->info;
+    Backdrop *backdrop = &s->backdrop;
+    Visual *visual = DefaultVisual(dpy, s->num);
+    int depth = DefaultDepth(dpy, s->num);
+
+    if (wallpaper.path && wallpaper.blur) {
+        fprintf(stderr, "Warning: --blur applies to the desktop, ignored with --background-image.\n");
+        wallpaper.blur = 0;
+    }
+    if (wallpaper.path == NULL && !wallpaper.blur)
+        return;
+    if (visual->class != TrueColor || (depth != 24 && depth != 32) ||
+            visual->red_mask != 0xff0000 || visual->green_mask != 0xff00 || visual->blue_mask != 0xff) {
+        /* other screens may still have one */
+        fprintf(stderr, "Warning: background images need a 24 bit TrueColor visual (screen %d).\n", s->num);
+        return;
+    }
+
+    if (backdrop->pixmap != None)
+        XFreePixmap(dpy, backdrop->pixmap);
+    backdrop->width = info->display_width;
+    backdrop->height = info->display_height;
+    backdrop->pixmap = XCreatePixmap(dpy, s->root, backdrop->width, backdrop->height, depth);
+    if (backdrop->gc == NULL)
+        backdrop->gc = XCreateGC(dpy, backdrop->pixmap, 0, NULL);
+
+    /* areas no output shows */
+    XSetForeground(dpy, backdrop->gc, s->background.pixel);
+    XFillRectangle(dpy, backdrop->pixmap, backdrop->gc, 0, 0, backdrop->width, backdrop->height);
+
+    /* a blurred desktop is captured when locking */
+    for (int i = 0; i < info->noutputs; i++)
+        if (!output_is_clone(info, i))
+            wallpaper_paint_output(s, &info->outputs[i]);
+    if (wallpaper.path == NULL && !wallpaper.blur) {
+        XFreePixmap(dpy, backdrop->pixmap);
+        backdrop->pixmap = None;
+    }
+}
+
+/*
+ * Takes a screenshot of every output, blurs it and makes it the background.
+ * Pixels go through shared memory both ways when the server is local, and
+ * each output is blurred on its own so nothing bleeds across their edges.
+ *
+ */
+static void
+wallpaper_capture(LockScreen *s) {
+    const WindowPositionInfo *info = &s->info;
+    XShmSegmentInfo shm;
+    XImage *ximage;
+
+    if (s->backdrop.pixmap == None)
+        return;
+
+    for (int i = 0; i < info->noutputs; i++) {
+        const OutputInfo *output = &info->outputs[i];
+        uint64_t start = stats_enabled ? stats_now() : 0;
+
+        if (output_is_clone(info, i))
+            continue;
+        if ((ximage = upload_create(s, &shm, output->width, output->height, NULL)) == NULL)
+            continue;
+
+        if (shm.shmaddr) {
+            XShmGetImage(dpy, s->root, ximage, output->x, output->y, AllPlanes);
+        } else if (!XGetSubImage(dpy, s->root, output->x, output->y, output->width, output->height,
+                    AllPlanes, ZPixmap, ximage, 0, 0)) {
+            upload_put(s, &shm, ximage, output->x, output->y, False);
+            continue;
+        }
+        uint64_t captured = stats_enabled ? stats_now() : 0;
+
+        uint64_t trace = TRACE_START();
+        blur((uint32_t *)ximage->data, output->width, output->height,
+                ximage->bytes_per_line / sizeof(uint32_t), wallpaper.blur);
+        TRACE_SPAN("blur", trace, i);
+        uint64_t blurred = stats_enabled ? stats_now() : 0;
+
+        upload_put(s, &shm, ximage, output->x, output->y, False);
+
+        if (stats_enabled) {
+            XSync(dpy, False);
+            stats_record(STATS_CAPTURE, captured - start);
+            stats_record(STATS_BLUR, blurred - captured);
+            stats_record(STATS_UPLOAD, stats_now() - blurred);
+        }
+    }
+}
+
+/*
+ * Follows a new screen size: a new pixmap becomes the window background and
+ * the tile the canvases clear with.
+ *
+ */
+static void
+wallpaper_resize(LockScreen *s) {
+    const WindowPositionInfo *info = &s->info;
+    Backdrop *backdrop = &s->backdrop;
+
+    if (backdrop->pixmap == None ||
+            (backdrop->width == info->display_width && backdrop->height == info->display_height))
+        return;
+
+    wallpaper_create(s);
+    if (backdrop->pixmap == None)
+        return;
+    /* a blanked window gets it when woken */
+    if (power.state == POWER_ACTIVE)
+        XSetWindowBackgroundPixmap(dpy, s->win, backdrop->pixmap);
+    for (int i = 0; i < MAX_OUTPUTS; i++) {
+        s->canvases[i].tile = backdrop->pixmap;
+        if (i < info->noutputs && s->canvases[i].back != None)
+            XSetTile(dpy, s->canvases[i].clear_gc, backdrop->pixmap);
+    }
+}
+
+static void
+wallpaper_free(LockScreen *s) {
+    if (s->backdrop.pixmap != None)
+        XFreePixmap(dpy, s->backdrop.pixmap);
+    if (s->backdrop.gc)
+        XFreeGC(dpy, s->backdrop.gc);
+    s->backdrop.pixmap = None;
+    s->backdrop.gc = NULL;
+}
+
+/*
+ * Applies a CRTC change reported by RandR. The event carries the new
+ * geometry, so nothing is queried from the server and only the canvas of
+ * the affected output is laid out again. The event has the size of the
+ * mode, unrotated, while GetCrtcInfo at startup reports the area covered.
+ *
+ */
+static void
+output_crtc_changed(LockScreen *s, XRRCrtcChangeNotifyEvent *event) {
+    WindowPositionInfo *info = &s->info;
+    X11Canvas *canvases = s->canvases;
+    int n;
+    Bool active = event->mode != None && event->width > 0 && event->height > 0;
+    Bool rotated = (event->rotation & (RR_Rotate_90 | RR_Rotate_270)) != 0;
+    int width = rotated ? (int)event->height : (int)event->width;
+    int height = rotated ? (int)event->width : (int)event->height;
+
+    for (n = 0; n < info->noutputs; n++)
+        if (info->outputs[n].crtc == event->crtc)
+            break;
+
+    /* the fallback output goes away as soon as RandR reports a real one */
+    if (n == info->noutputs && active && info->noutputs == 1 && info->outputs[0].crtc == None)
+        n = 0;
+
+    if (n < info->noutputs) {
+        OutputInfo *o = &info->outputs[n];
+        if (active && o->crtc == event->crtc && o->x == event->x && o->y == event->y &&
+                o->width == width && o->height == height)
+            return;
+        /* wipe what this output showed at its old place */
+        XClearArea(dpy, canvases[n].win, o->x, o->y, o->width, o->height, False);
+    } else if (!active || info->noutputs == MAX_OUTPUTS) {
+        return;
+    } else {
+        /* a new output, start from a copy of the first canvas */
+        canvases[n] = canvases[0];
+        canvases[n].back = None;
+#ifdef USE_XFT
+        canvases[n].xftdraw = NULL;
+#endif
+        x11_set_target(&canvases[n], canvases[n].win);
+        info->noutputs++;
+    }
+
+    if (!active) {
+        x11_canvas_free(&canvases[n]);
+        info->noutputs--;
+        info->outputs[n] = info->outputs[info->noutputs];
+        canvases[n] = canvases[info->noutputs];
+    } else {
+        info->outputs[n].crtc = event->crtc;
+        info->outputs[n].x = event->x;
+        info->outputs[n].y = event->y;
+        info->outputs[n].width = width;
+        info->outputs[n].height = height;
+        if (!output_is_clone(info, n))
+            wallpaper_paint_output(s, &info->outputs[n]);
+        output_layout(s, n);
+    }
+
+    /* other outputs may have become clones of this one, or stopped being
+     * one, the output moved into a removed one's place too; whatever a
+     * clone showed is already painted */
+    int laid_out = active ? n : -1;
+    for (int i = 0; i < info->noutputs; i++)
+        if (i != laid_out && output_is_clone(info, i) != canvases[i].clone)
+            output_layout(s, i);
+}
+
+/*
+ * Splits the symbols name into layout names. It looks like
+ * "pc+us+ru:2+inet(evdev)": every token after the first one and before the
+ * first ':' is the name of one layout group.
+ *
+ */
+static void
+keyboard_parse_layouts(Keyboard *keyboard) {
+    keyboard->ngroups = 0;
+    if (keyboard->layout == NULL)
+        return;
+
+    int tokenCount = 0;
+    for (char *tmp = keyboard->layout; *tmp != '\0' && *tmp != ':'; tmp++)
+        if (*tmp == '+')
+            tokenCount++;
+
+    strtok(keyboard->layout, "+:"); //skip the first token, like 'pc'
+    for (int i = 0; i < tokenCount && i < XkbNumKbdGroups; i++) {
+        if ((keyboard->groups[i] = strtok(NULL, "+:")) == NULL)
+            break;
+        keyboard->ngroups++;
+    }
+}
+
+/*
+ * Rereads the layout names of the core keyboard after they changed, only
+ * when they are about to be shown.
+ *
+ */
+static void
+keyboard_load_layouts(Keyboard *keyboard) {
+    XkbDescRec *desc;
+    uint64_t trace = TRACE_START();
+
+    free(keyboard->layout);
+    keyboard->layout = NULL;
+    keyboard->stale = False;
+
+    if ((desc = XkbAllocKeyboard()) == NULL)
+        return;
+    if (XkbGetNames(dpy, XkbSymbolsNameMask, desc) == Success && desc->names->symbols != None) {
+        char *name = XGetAtomName(dpy, desc->names->symbols);
+        if (name) {
+            keyboard->layout = strdup(name);
+            XFree(name);
+        }
+    }
+    STATS_ROUNDTRIP(2);
+    XkbFreeKeyboard(desc, 0, True);
+
+    keyboard_parse_layouts(keyboard);
+    TRACE_SPAN("xkb_layouts", trace, keyboard->ngroups);
+}
+
+/*
+ * Subscribes to the XKB events which keep the keyboard cache up to date, so
+ * the event loop never has to ask the server. The initial state comes with
+ * the startup replies.
+ *
+ */
+static void
+keyboard_init(Keyboard *keyboard) {
+    int opcode, error, major = XkbMajorVersion, minor = XkbMinorVersion;
+
+    memset(keyboard, 0, sizeof(*keyboard));
+
+    /* answered from the state Xlib set up when opening the display */
+    if (!XkbQueryExtension(dpy, &opcode, &keyboard->event_base, &error, &major, &minor)) {
+        keyboard->event_base = -1;
+        fprintf(stderr, "Warning: XKB not available, layout and caps lock state will not be shown.\n");
+        return;
+    }
+
+    XkbSelectEventDetails(dpy, XkbUseCoreKbd, XkbStateNotify,
+            XkbGroupStateMask, XkbGroupStateMask);
+    XkbSelectEventDetails(dpy, XkbUseCoreKbd, XkbIndicatorStateNotify,
+            XkbAllIndicatorsMask, XkbAllIndicatorsMask);
+    XkbSelectEventDetails(dpy, XkbUseCoreKbd, XkbNamesNotify,
+            XkbAllNamesMask, XkbSymbolsNameMask | XkbGroupNamesMask);
+}
+
+/*
+ * Everything the resolved fonts and colors depend on: the server and the
+ * options naming them.
+ *
+ */
+static uint64_t
+resources_key(void) {
+    const char *values[] = {
+        ServerVendor(dpy), opt_font, opt_xftfont ? opt_xftfont : "",
+        opt_background_color, opt_text_color, opt_errmsg_color,
+    };
+    int release = VendorRelease(dpy);
+    uint64_t key = cache_hash(CACHE_HASH_INIT, &release, sizeof(release));
+
+    for (unsigned int i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        key = cache_hash(key, values[i], strlen(values[i]) + 1);
+    return key;
+}
+
+/*
+ * Loads what a previous run with the same server and options resolved.
+ * Returns False without a usable entry, path is left empty without a cache
+ * directory.
+ *
+ */
+static Bool
+resources_load(ResourceCache *cache, char *path, size_t size) {
+    char dir[PATH_MAX];
+    uint64_t key = resources_key();
+    Bool hit = False;
+
+    path[0] = '\0';
+    privileges_drop();
+    if (cache_dir(dir, sizeof(dir)) == 0 &&
+            (size_t)snprintf(path, size, "%s/resources-%016llx", dir, (unsigned long long)key) < size)
+        hit = resource_cache_load(cache, path, key) == 0;
+    else
+        path[0] = '\0';
+    privileges_restore();
+
+    if (!hit)
+        cache->key = key;
+    return hit;
+}
+
+static void
+resources_store(const ResourceCache *cache, const char *path) {
+    if (!*path)
+        return;
+    privileges_drop();
+    resource_cache_store(cache, path);
+    privileges_restore();
+}
+
+/*
+ * First wave: asks for the extensions needed later and allocates the colors
+ * in the colormap of every screen. Nothing here waits for the server.
+ *
+ */
+static void
+startup_begin(Startup *st, int nscreens, const char *specs[COLOR_COUNT], const ResourceCache *cached) {
+    memset(st, 0, sizeof(*st));
+    st->c = XGetXCBConnection(dpy);
+    st->nscreens = nscreens;
+
+    /* a cached font is only valid for the font path it was resolved on */
+    st->font_path = xcb_get_font_path(st->c);
+
+    xcb_prefetch_extension_data(st->c, &xcb_randr_id);
+    xcb_prefetch_extension_data(st->c, &xcb_xkb_id);
+    xcb_prefetch_extension_data(st->c, &xcb_present_id);
+
+    for (int n = 0; n < nscreens; n++) {
+        Colormap cmap = DefaultColormap(dpy, n);
+
+        for (int i = 0; i < COLOR_COUNT; i++) {
+            XColor *color = &st->screens[n].colors[i].parsed;
+
+            st->screens[n].colors[i].spec = specs[i];
+            if (cached && cached->ncolors == COLOR_COUNT) {
+                /* resolved by a previous run, neither parsed nor looked up */
+                color->red = cached->colors[i].red;
+                color->green = cached->colors[i].green;
+                color->blue = cached->colors[i].blue;
+                st->screens[n].colors[i].cookie =
+                    xcb_alloc_color(st->c, cmap, color->red, color->green, color->blue);
+                continue;
+            }
+
+            /* hex and rgb: specifications are parsed without the server */
+            st->screens[n].colors[i].named = specs[i][0] != '#' && strncmp(specs[i], "rgb:", 4) != 0;
+            if (st->screens[n].colors[i].named) {
+                st->screens[n].colors[i].named_cookie =
+                    xcb_alloc_named_color(st->c, cmap, strlen(specs[i]), specs[i]);
+            } else {
+                if (!XParseColor(dpy, cmap, specs[i], color))
+                    die("error: can not parse %s: %s\n", color_names[i], specs[i]);
+                st->screens[n].colors[i].cookie =
+                    xcb_alloc_color(st->c, cmap, color->red, color->green, color->blue);
+            }
+        }
+    }
+
+    xcb_flush(st->c);
+}
+
+/*
+ * Second wave: the queries which only needed the extension replies.
+ *
+ */
+static void
+startup_send_queries(Startup *st) {
+    const xcb_query_extension_reply_t *ext;
+
+    ext = xcb_get_extension_data(st->c, &xcb_randr_id);
+    if ((st->have_randr = ext && ext->present))
+        for (int n = 0; n < st->nscreens; n++)
+            st->screens[n].resources = xcb_randr_get_screen_resources_current(st->c, RootWindow(dpy, n));
+
+    ext = xcb_get_extension_data(st->c, &xcb_xkb_id);
+    if ((st->have_xkb = ext && ext->present)) {
+        st->xkb_state = xcb_xkb_get_state(st->c, XCB_XKB_ID_USE_CORE_KBD);
+        st->xkb_indicators = xcb_xkb_get_indicator_state(st->c, XCB_XKB_ID_USE_CORE_KBD);
+        st->xkb_names = xcb_xkb_get_names(st->c, XCB_XKB_ID_USE_CORE_KBD, XCB_XKB_NAME_DETAIL_SYMBOLS);
+    }
+
+    ext = xcb_get_extension_data(st->c, &xcb_present_id);
+    st->have_present = ext && ext->present;
+
+    xcb_flush(st->c);
+}
+
+/*
+ * Hash of the server's font path, 0 when it is unknown.
+ *
+ */
+static uint64_t
+startup_font_path(Startup *st) {
+    if (st->have_font_path)
+        return st->font_path_hash;
+
+    xcb_get_font_path_reply_t *reply = xcb_get_font_path_reply(st->c, st->font_path, NULL);
+    st->have_font_path = True;
+    if (reply) {
+        /* the STR list of the reply, as sent */
+        st->font_path_hash = cache_hash(CACHE_HASH_INIT, reply + 1, reply->length * 4);
+        st->font_path_hash = cache_hash(st->font_path_hash, &reply->path_len, sizeof(reply->path_len));
+        free(reply);
+    }
+    return st->font_path_hash;
+}
+
+static void
+startup_collect_colors(Startup *st, int screen, XColor colors[COLOR_COUNT]) {
+    for (int i = 0; i < COLOR_COUNT; i++) {
+        StartupColor *c = &st->screens[screen].colors[i];
+
+        colors[i] = c->parsed;
+        colors[i].flags = DoRed | DoGreen | DoBlue;
+
+        if (c->named) {
+            xcb_alloc_named_color_reply_t *reply =
+                xcb_alloc_named_color_reply(st->c, c->named_cookie, NULL);
+            if (!reply)
+                die("error: can not parse %s: %s\n", color_names[i], c->spec);
+            /* what XParseColor() would have returned, for the cache */
+            c->parsed.red = reply->exact_red;
+            c->parsed.green = reply->exact_green;
+            c->parsed.blue = reply->exact_blue;
+            colors[i].pixel = reply->pixel;
+            colors[i].red = reply->visual_red;
+            colors[i].green = reply->visual_green;
+            colors[i].blue = reply->visual_blue;
+            free(reply);
+        } else {
+            xcb_alloc_color_reply_t *reply =
+                xcb_alloc_color_reply(st->c, c->cookie, NULL);
+            if (!reply)
+                continue;
+            colors[i].pixel = reply->pixel;
+            colors[i].red = reply->red;
+            colors[i].green = reply->green;
+            colors[i].blue = reply->blue;
+            free(reply);
+        }
+    }
+}
+
+/*
+ * Third wave: CRTC geometry and the layout name, which depend on the second
+ * wave's replies. Fills the output list of every screen and the keyboard
+ * cache.
+ *
+ */
+static void
+startup_finish(Startup *st, LockDisplay *d) {
+    Keyboard *keyboard = &d->keyboard;
+    xcb_randr_get_crtc_info_cookie_t crtc_cookies[MAX_SCREENS][MAX_OUTPUTS * 2];
+    xcb_randr_crtc_t *crtcs[MAX_SCREENS] = { NULL };
+    int ncrtcs[MAX_SCREENS] = { 0 };
+    xcb_randr_get_screen_resources_current_reply_t *resources[MAX_SCREENS] = { NULL };
+    xcb_get_atom_name_cookie_t layout_cookie;
+    Bool have_layout = False;
+
+    for (int n = 0; st->have_randr && n < st->nscreens; n++) {
+        resources[n] = xcb_randr_get_screen_resources_current_reply(st->c, st->screens[n].resources, NULL);
+        if (resources[n] == NULL)
+            continue;
+        crtcs[n] = xcb_randr_get_screen_resources_current_crtcs(resources[n]);
+        ncrtcs[n] = MIN(xcb_randr_get_screen_resources_current_crtcs_length(resources[n]),
+                (int)(sizeof(crtc_cookies[n]) / sizeof(crtc_cookies[n][0])));
+        for (int i = 0; i < ncrtcs[n]; i++)
+            crtc_cookies[n][i] = xcb_randr_get_crtc_info(st->c, crtcs[n][i], resources[n]->config_timestamp);
+    }
+
+    if (st->have_xkb) {
+        xcb_xkb_get_names_reply_t *names = xcb_xkb_get_names_reply(st->c, st->xkb_names, NULL);
+        if (names) {
+            xcb_xkb_get_names_value_list_t list;
+            xcb_xkb_get_names_value_list_unpack(xcb_xkb_get_names_value_list(names),
+                    names->nTypes, names->indicators, names->virtualMods, names->groupNames,
+                    names->nKeys, names->nKeyAliases, names->nRadioGroups, names->which, &list);
+            if (list.symbolsName != XCB_NONE) {
+                layout_cookie = xcb_get_atom_name(st->c, list.symbolsName);
+                have_layout = True;
+            }
+            free(names);
+        }
+    }
+
+    xcb_flush(st->c);
+
+    /* outputs */
+    for (int n = 0; n < st->nscreens; n++) {
+        WindowPositionInfo *info = &d->screens[n].info;
+
+        info->noutputs = 0;
+        for (int i = 0; i < ncrtcs[n]; i++) {
+            xcb_randr_get_crtc_info_reply_t *crtc = xcb_randr_get_crtc_info_reply(st->c, crtc_cookies[n][i], NULL);
+            if (crtc == NULL)
+                continue;
+            if (crtc->mode != XCB_NONE && crtc->width > 0 && crtc->height > 0 && info->noutputs < MAX_OUTPUTS) {
+                OutputInfo *output = &info->outputs[info->noutputs++];
+                output->crtc = crtcs[n][i];
+                output->x = crtc->x;
+                output->y = crtc->y;
+                output->width = crtc->width;
+                output->height = crtc->height;
+            }
+            free(crtc);
+        }
+        free(resources[n]);
+    }
+
+    /* keyboard state */
+    if (st->have_xkb) {
+        xcb_xkb_get_state_reply_t *state = xcb_xkb_get_state_reply(st->c, st->xkb_state, NULL);
+        xcb_xkb_get_indicator_state_reply_t *indicators =
+            xcb_xkb_get_indicator_state_reply(st->c, st->xkb_indicators, NULL);
+        if (state)
+            keyboard->group = state->group;
+        if (indicators)
+            keyboard->caps = indicators->state & 1;
+        free(state);
+        free(indicators);
+    }
+    if (have_layout) {
+        xcb_get_atom_name_reply_t *name = xcb_get_atom_name_reply(st->c, layout_cookie, NULL);
+        if (name) {
+            int len = xcb_get_atom_name_name_length(name);
+            if ((keyboard->layout = malloc(len + 1))) {
+                memcpy(keyboard->layout, xcb_get_atom_name_name(name), len);
+                keyboard->layout[len] = '\0';
+            }
+            free(name);
+        }
+        keyboard_parse_layouts(keyboard);
+    }
+}
+
+/*
+ * Updates the cache from an XKB event. Widgets pick the changes up on the
+ * next frame and repaint only if what they show actually changed.
+ *
+ */
+static void
+keyboard_handle_event(Keyboard *keyboard, XEvent *event) {
+    XkbEvent *xkb = (XkbEvent *)event;
+
+    TRACE_INSTANT("xkb_event", xkb->any.xkb_type);
+    switch (xkb->any.xkb_type) {
+        case XkbStateNotify:
+            keyboard->group = xkb->state.group;
+            break;
+        case XkbIndicatorStateNotify:
+            keyboard->caps = xkb->indicators.state & 1;
+            break;
+        case XkbNamesNotify:
+            if (xkb->names.changed & (XkbSymbolsNameMask | XkbGroupNamesMask))
+                keyboard->stale = True;
+            break;
+    }
+}
+
+/*
+ * Returns the resolution of the clock in seconds: how often the text
+ * produced by strftime() with the given format can change.
+ *
+ */
+static int
+clock_period(const char *format) {
+    for (const char *c = format; (c = strchr(c, '%')) != NULL; c += 2) {
+        if (c[1] == '\0')
+            break;
+        if (strchr("STrcXs", c[1]))
+            return 1;
+    }
+    return 60;
+}
+
+/*
+ * Arms the clock timer to expire on every period boundary of the wall clock,
+ * so the process wakes exactly once per displayed clock change.
+ *
+ */
+static void
+clock_arm(int fd, int period) {
+    struct itimerspec its;
+    time_t now = time(NULL);
+
+    its.it_value.tv_sec = now - now % period + period;
+    its.it_value.tv_nsec = 0;
+    its.it_interval.tv_sec = period;
+    its.it_interval.tv_nsec = 0;
+    if (timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) == -1)
+        fprintf(stderr, "Warning: cannot arm clock timer: %s\n", strerror(errno));
+}
+
+/*
+ * Creates the clock timer. Returns -1 when timerfd is not available, then the
+ * main loop reads the clock before every frame and wakes up by itself when
+ * it is due, see clock_timeout().
+ *
+ */
+static int
+clock_create(const char *format) {
+    int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Warning: cannot create clock timer: %s\n", strerror(errno));
+        return -1;
+    }
+    clock_arm(fd, clock_period(format));
+    return fd;
+}
+
+/*
+ * Without the clock timer: the poll() timeout until the next period boundary
+ * of the wall clock.
+ *
+ */
+static int
+clock_timeout(int period) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (period - ts.tv_sec % period) * 1000 - ts.tv_nsec / 1000000;
+}
+
+/*
+ * Milliseconds of a clock which is not affected by setting the system time.
+ *
+ */
+static uint64_t
+monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The earlier of two poll() timeouts, -1 being none.
+ *
+ */
+static int
+timeout_min(int a, int b) {
+    if (a == -1)
+        return b;
+    if (b == -1)
+        return a;
+    return MIN(a, b);
+}
+
+#ifdef USE_XI
+/*
+ * Sets up the XInput 2 input path: the master devices of the client pointer
+ * are grabbed instead of the core ones. Raw events reach the root window
+ * whatever the grabs since XInput 2.1. Falls back to the core input path.
+ *
+ */
+static void
+xi_init(Xi *xi, Window root) {
+    int event, error, major = 2, minor = 1, ndevices;
+    XIDeviceInfo *info;
+
+    xi->opcode = -1;
+    xi->root = root;
+    xi->source = -1;
+    if (!XQueryExtension(dpy, "XInputExtension", &xi->opcode, &event, &error) ||
+            XIQueryVersion(dpy, &major, &minor) != Success || major < 2 || (major == 2 && minor < 1)) {
+        fprintf(stderr, "Warning: XInput 2.1 not available on %s, using core input.\n", DisplayString(dpy));
+        xi->opcode = -1;
+        return;
+    }
+
+    if (!XIGetClientPointer(dpy, None, &xi->pointer) ||
+            (info = XIQueryDevice(dpy, xi->pointer, &ndevices)) == NULL) {
+        fprintf(stderr, "Warning: no XInput 2 master pointer on %s, using core input.\n", DisplayString(dpy));
+        xi->opcode = -1;
+        return;
+    }
+    xi->keyboard = info->attachment;
+    XIFreeDeviceInfo(info);
+}
+
+/*
+ * Selects raw motion of every master pointer on the root window, or stops
+ * it. Only the first motion after a quiet interval is needed to know there
+ * was some.
+ *
+ */
+static void
+xi_select_motion(Xi *xi, Bool select) {
+    unsigned char bits[XIMaskLen(XI_LASTEVENT)] = { 0 };
+    XIEventMask mask = { XIAllMasterDevices, sizeof(bits), bits };
+
+    if (select)
+        XISetMask(bits, XI_RawMotion);
+    XISelectEvents(dpy, xi->root, &mask, 1);
+    xi->motion = select;
+    xi->rearm = 0;
+}
+
+static Bool
+xi_grab(Xi *xi, int device, Cursor cursor, int type) {
+    unsigned char bits[XIMaskLen(XI_LASTEVENT)] = { 0 };
+    XIEventMask mask = { device, sizeof(bits), bits };
+
+    XISetMask(bits, type);
+    return XIGrabDevice(dpy, device, xi->root, CurrentTime, cursor, XIGrabModeAsync,
+            XIGrabModeAsync, False, &mask) == GrabSuccess;
+}
+
+/*
+ * Turns XInput 2 events into the core events the main loop handles. Raw
+ * motion becomes one MotionNotify per frame interval, the server keeps the
+ * rest to itself meanwhile. While a password is being typed, keys of other
+ * devices (a second keyboard, a barcode scanner) are dropped; when it has
+ * been left alone for XI_SOURCE_TIMEOUT another device takes over and the
+ * partial password is discarded. Returns True if the event was consumed.
+ *
+ */
+static Bool
+xi_handle_event(Xi *xi, XEvent *event, Prompt *prompt) {
+    XEvent core;
+    Bool consumed = True;
+
+    if (xi->opcode == -1 || event->type != GenericEvent || event->xcookie.extension != xi->opcode)
+        return False;
+    if (!XGetEventData(dpy, &event->xcookie))
+        return True;
+
+    memset(&core, 0, sizeof(core));
+    switch (event->xcookie.evtype) {
+        case XI_RawMotion:
+            if (!xi->motion)
+                break;
+            xi_select_motion(xi, False);
+            xi->rearm = monotonic_ms() + FRAME_INTERVAL;
+            core.type = MotionNotify;
+            consumed = False;
+            break;
+        case XI_ButtonPress:
+            core.type = ButtonPress;
+            consumed = False;
+            break;
+        case XI_KeyPress: {
+            XIDeviceEvent *ev = event->xcookie.data;
+            if (ev->sourceid != xi->source && prompt->len > 0) {
+                if (ev->time - xi->source_time < XI_SOURCE_TIMEOUT)
+                    break;
+                prompt_key(prompt, PROMPT_KEY_CANCEL, 0, False);
+            }
+            xi->source = ev->sourceid;
+            xi->source_time = ev->time;
+
+            core.xkey.type = KeyPress;
+            core.xkey.serial = ev->serial;
+            core.xkey.display = dpy;
+            core.xkey.window = ev->event;
+            core.xkey.root = ev->root;
+            core.xkey.subwindow = ev->child;
+            core.xkey.time = ev->time;
+            core.xkey.x = ev->event_x;
+            core.xkey.y = ev->event_y;
+            core.xkey.x_root = ev->root_x;
+            core.xkey.y_root = ev->root_y;
+            core.xkey.state = ev->mods.effective | (ev->group.effective & 3) << 13;
+            core.xkey.keycode = ev->detail;
+            core.xkey.same_screen = True;
+            consumed = False;
+            break;
+        }
+    }
+    XFreeEventData(dpy, &event->xcookie);
+
+    if (!consumed)
+        *event = core;
+    return consumed;
+}
+
+/*
+ * Selects raw motion again when the frame interval is over. Returns the
+ * poll() timeout until then, -1 when nothing is waiting.
+ *
+ */
+static int
+xi_timeout(Xi *xi) {
+    if (xi->opcode == -1 || xi->rearm == 0)
+        return -1;
+
+    uint64_t now = monotonic_ms();
+    if (now >= xi->rearm) {
+        xi_select_motion(xi, True);
+        return -1;
+    }
+    return (int)(xi->rearm - now);
+}
+#endif
+
+/*
+ * The core pointer grab reports motion, the XInput 2 grab only button
+ * presses: raw motion is selected separately and rate limited.
+ *
+ */
+static Bool
+grab_pointer(Grab *grab) {
+#ifdef USE_XI
+    if (grab->xi && grab->xi->opcode != -1)
+        return xi_grab(grab->xi, grab->xi->pointer, grab->cursor, XI_ButtonPress);
+#endif
+    return XGrabPointer(dpy, grab->root, False, ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
+            GrabModeAsync, GrabModeAsync, None, grab->cursor, CurrentTime) == GrabSuccess;
+}
+
+static Bool
+grab_keyboard(Grab *grab) {
+#ifdef USE_XI
+    if (grab->xi && grab->xi->opcode != -1)
+        return xi_grab(grab->xi, grab->xi->keyboard, None, XI_KeyPress);
+#endif
+    return XGrabKeyboard(dpy, grab->root, True, GrabModeAsync, GrabModeAsync, CurrentTime) == GrabSuccess;
+}
+
+/*
+ * Gives both grabs back.
+ *
+ */
+static void
+grab_release(Grab *grab) {
+#ifdef USE_XI
+    if (grab->xi && grab->xi->opcode != -1) {
+        XIUngrabDevice(dpy, grab->xi->keyboard, CurrentTime);
+        XIUngrabDevice(dpy, grab->xi->pointer, CurrentTime);
+        xi_select_motion(grab->xi, False);
+        grab->keyboard = False;
+        grab->pointer = False;
+        return;
+    }
+#endif
+    XUngrabKeyboard(dpy, CurrentTime);
+    XUngrabPointer(dpy, CurrentTime);
+    grab->keyboard = False;
+    grab->pointer = False;
+}
+
+/*
+ * Tries to get the grabs not held yet, the keyboard and the pointer
+ * independently. On failure the next attempt is scheduled with a doubled
+ * delay. Returns True when both are held.
+ *
+ */
+static Bool
+grab_try(Grab *grab) {
+    uint64_t trace = TRACE_START();
+    if (!grab->pointer && grab_pointer(grab)) {
+        grab->pointer = True;
+        stats_mark(STATS_GRAB_POINTER);
+    }
+    if (!grab->keyboard && grab_keyboard(grab)) {
+        grab->keyboard = True;
+        stats_mark(STATS_GRAB_KEYBOARD);
+    }
+    /* arg: 1 pointer held, 2 keyboard held */
+    TRACE_SPAN("grab", trace, grab->pointer | grab->keyboard << 1);
+
+    if (grab->pointer && grab->keyboard) {
+        grab->delay = GRAB_DELAY_MIN;
+        return True;
+    }
+
+    grab->next_try = monotonic_ms() + grab->delay;
+    grab->delay = MIN(grab->delay * 2, GRAB_DELAY_MAX);
+    return False;
+}
+
+/*
+ * Gets both grabs at startup, another client (like an open menu) may hold
+ * them for a while. Gives up after timeout ms.
+ *
+ */
+static Bool
+grab_acquire(Grab *grab, int timeout) {
+    uint64_t deadline = monotonic_ms() + timeout;
+
+    grab->delay = GRAB_DELAY_MIN;
+    while (!grab_try(grab)) {
+        uint64_t now = monotonic_ms();
+        if (now >= deadline)
+            return False;
+        poll(NULL, 0, (int)(MIN(grab->next_try, deadline) - now));
+    }
+    return True;
+}
+
+/*
+ * Watches for lost grabs. When the keyboard grab ends the grab window gets
+ * FocusOut (NotifyUngrab, or NotifyGrab when another client took it over),
+ * for the pointer the lock window gets EnterNotify (NotifyUngrab) or
+ * LeaveNotify (NotifyGrab). Lost grabs are taken back at once. Returns True
+ * if the event was consumed.
+ *
+ */
+static Bool
+grab_handle_event(Grab *grab, XEvent *event) {
+    switch (event->type) {
+        case FocusOut:
+            if (event->xfocus.window != grab->root)
+                return False;
+            if (event->xfocus.mode == NotifyGrab || event->xfocus.mode == NotifyUngrab)
+                grab->keyboard = False;
+            break;
+        case EnterNotify:
+        case LeaveNotify:
+            if (event->xcrossing.window != grab->win)
+                return False;
+            if ((event->type == EnterNotify && event->xcrossing.mode == NotifyUngrab) ||
+                    (event->type == LeaveNotify && event->xcrossing.mode == NotifyGrab &&
+                     event->xcrossing.detail != NotifyAncestor))
+                grab->pointer = False;
+            break;
+        default:
+            return False;
+    }
+
+    if (!grab->pointer || !grab->keyboard) {
+        grab->delay = GRAB_DELAY_MIN;
+        grab_try(grab);
+    }
+    return True;
+}
+
+/*
+ * Retries lost grabs when their time has come. Returns the poll() timeout
+ * until the next attempt, -1 when both grabs are held.
+ *
+ */
+static int
+grab_timeout(Grab *grab) {
+    if (grab->pointer && grab->keyboard)
+        return -1;
+
+    uint64_t now = monotonic_ms();
+    if (now >= grab->next_try) {
+        if (grab_try(grab))
+            return -1;
+        now = monotonic_ms();
+    }
+    return grab->next_try > now ? (int)(grab->next_try - now) : 0;
+}
+
+/*
+ * Asks Present for vblank notifications on the lock window. They arrive in
+ * their own queue, Xlib never sees them.
+ *
+ */
+static void
+pacer_init(Pacer *pacer, xcb_connection_t *c, Bool have_present, Window w) {
+    memset(pacer, 0, sizeof(*pacer));
+    pacer->c = c;
+    pacer->win = w;
+    if (!have_present)
+        return;
+
+    uint32_t eid = xcb_generate_id(c);
+    pacer->special = xcb_register_for_special_xge(c, &xcb_present_id, eid, &pacer->stamp);
+    if (pacer->special)
+        xcb_present_select_input(c, eid, w, XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY);
+}
+
+/*
+ * A frame was sent, the next one waits for the vblank after it.
+ *
+ */
+static void
+pacer_frame(Pacer *pacer) {
+    pacer->waiting = True;
+    if (pacer->special) {
+        xcb_present_notify_msc(pacer->c, pacer->win, ++pacer->serial, 0, 1, 0);
+        pacer->next_frame = monotonic_ms() + FRAME_TIMEOUT;
+    } else {
+        pacer->next_frame = monotonic_ms() + FRAME_INTERVAL;
+    }
+}
+
+/*
+ * Takes the vblank notifications xcb has read so far. Returns True when a
+ * frame may be sent.
+ *
+ */
+static Bool
+pacer_ready(Pacer *pacer) {
+    if (!pacer->waiting)
+        return True;
+
+    if (pacer->special) {
+        xcb_generic_event_t *ev;
+        while ((ev = xcb_poll_for_special_event(pacer->c, pacer->special))) {
+            xcb_present_complete_notify_event_t *complete = (xcb_present_complete_notify_event_t *)ev;
+            if (complete->event_type == XCB_PRESENT_EVENT_COMPLETE_NOTIFY && complete->serial == pacer->serial)
+                pacer->waiting = False;
+            free(ev);
+        }
+    }
+    if (pacer->waiting && monotonic_ms() >= pacer->next_frame)
+        pacer->waiting = False;
+    return !pacer->waiting;
+}
+
+/*
+ * Returns the poll() timeout until a frame may be sent, -1 when frames are
+ * not held back.
+ *
+ */
+static int
+pacer_timeout(Pacer *pacer) {
+    if (!pacer->waiting)
+        return -1;
+    /* the vblank came while the last frame was sent, a held back frame
+     * goes out right away */
+    if (pacer_ready(pacer))
+        return 0;
+    uint64_t now = monotonic_ms();
+    return pacer->next_frame > now ? (int)(pacer->next_frame - now) : 0;
+}
+
+static void
+pacer_free(Pacer *pacer) {
+    if (pacer->special)
+        xcb_unregister_for_special_event(pacer->c, pacer->special);
+}
+
+/*
+ * Sets up the IDLETIME alarms. The server tells us when the user was
+ * inactive for the timeout, nothing is polled.
+ *
+ */
+static void
+idle_init(Idle *idle, int seconds) {
+    int error_base, major, minor, ncounters;
+    XSyncSystemCounter *counters;
+    XSyncCounter counter = None;
+    XSyncAlarmAttributes attr;
+
+    idle->event_base = -1;
+    if (!XSyncQueryExtension(dpy, &idle->event_base, &error_base) ||
+            !XSyncInitialize(dpy, &major, &minor))
+        die("--idle-lock needs the SYNC extension\n");
+
+    counters = XSyncListSystemCounters(dpy, &ncounters);
+    for (int i = 0; i < ncounters; i++)
+        if (strcmp(counters[i].name, "IDLETIME") == 0)
+            counter = counters[i].counter;
+    if (counters)
+        XSyncFreeSystemCounterList(counters);
+    if (counter == None)
+        die("--idle-lock needs the IDLETIME counter of the SYNC extension\n");
+
+    XSyncIntsToValue(&idle->timeout, (unsigned int)seconds * 1000, 0);
+
+    attr.trigger.counter = counter;
+    attr.trigger.value_type = XSyncAbsolute;
+    attr.trigger.wait_value = idle->timeout;
+    XSyncIntToValue(&attr.delta, 0);
+    attr.events = True;
+
+    /* a comparison fires once, even when already idle for longer */
+    attr.trigger.test_type = XSyncPositiveComparison;
+    idle->idle = XSyncCreateAlarm(dpy, XSyncCACounter | XSyncCAValueType | XSyncCAValue |
+            XSyncCATestType | XSyncCADelta | XSyncCAEvents, &attr);
+
+    /* a transition stays armed, it fires whenever input ends an idle time */
+    attr.trigger.test_type = XSyncNegativeTransition;
+    idle->reset = XSyncCreateAlarm(dpy, XSyncCACounter | XSyncCAValueType | XSyncCAValue |
+            XSyncCATestType | XSyncCADelta | XSyncCAEvents, &attr);
+}
+
+/*
+ * Handles the alarm events. Sets *lock when the user was inactive for the
+ * timeout, the idle alarm is armed again by the next input. Returns True if
+ * the event was consumed.
+ *
+ */
+static Bool
+idle_handle_event(Idle *idle, XEvent *event, Bool *lock) {
+    XSyncAlarmAttributes attr;
+
+    if (idle->event_base == -1 || event->type != idle->event_base + XSyncAlarmNotify)
+        return False;
+
+    XSyncAlarmNotifyEvent *alarm = (XSyncAlarmNotifyEvent *)event;
+    if (alarm->alarm == idle->idle) {
+        *lock = True;
+    } else if (alarm->alarm == idle->reset) {
+        /* changing the trigger arms the alarm again */
+        attr.trigger.wait_value = idle->timeout;
+        XSyncChangeAlarm(dpy, idle->idle, XSyncCAValue, &attr);
+    }
+    return True;
+}
+
+/*
+ * Releases the alarms.
+ *
+ */
+static void
+idle_free(Idle *idle) {
+    if (idle->event_base == -1)
+        return;
+    XSyncDestroyAlarm(dpy, idle->idle);
+    XSyncDestroyAlarm(dpy, idle->reset);
+}
+
+/*
+ * Takes over DPMS for the time of a lock. The server's own timeouts are
+ * switched off, the states are entered from the event loop's timeout only.
+ *
+ */
+static void
+power_begin(void) {
+    power.dpms = False;
+    for (int i = 0; i < ndisplays; i++) {
+        LockDisplay *d = &displays[i];
+        display_use(d);
+
+        d->using_dpms = opt_usedpms && DPMSCapable(dpy);
+        if (!d->using_dpms)
+            continue;
+        /* save dpms timeouts to restore on exit */
+        DPMSGetTimeouts(dpy, &d->dpms_original.standby, &d->dpms_original.suspend, &d->dpms_original.off);
+        DPMSInfo(dpy, &d->dpms_original.level, &d->dpms_original.state);
+
+        DPMSSetTimeouts(dpy, 0, 0, 0);
+
+        /* force dpms enabled until exit */
+        DPMSEnable(dpy);
+        power.dpms = True;
+    }
+
+    power.state = POWER_ACTIVE;
+    power.requested = POWER_ACTIVE;
+    power.last_input = monotonic_ms();
+}
+
+/*
+ * Gives DPMS back to the servers with the settings they had before the lock.
+ *
+ */
+static void
+power_end(void) {
+    for (int i = 0; i < ndisplays; i++) {
+        LockDisplay *d = &displays[i];
+        if (!d->using_dpms)
+            continue;
+        display_use(d);
+        DPMSSetTimeouts(dpy, d->dpms_original.standby, d->dpms_original.suspend, d->dpms_original.off);
+        if (!d->dpms_original.state)
+            DPMSDisable(dpy);
+        d->using_dpms = False;
+    }
+    power.dpms = False;
+}
+
+/*
+ * Enters a deeper state on every display. The DPMS level is only set when
+ * the server reports a different one, input may already have woken the
+ * display on its own.
+ *
+ */
+static void
+power_enter(PowerState state) {
+    for (int i = 0; i < ndisplays; i++) {
+        LockDisplay *d = &displays[i];
+        display_use(d);
+
+        if (state >= POWER_DIMMED && power.state < POWER_DIMMED) {
+            for (int n = 0; n < d->nscreens; n++) {
+                XSetWindowBackground(dpy, d->screens[n].win, BlackPixel(dpy, n));
+                XClearWindow(dpy, d->screens[n].win);
+            }
+        }
+
+        if (state >= POWER_STANDBY && d->using_dpms) {
+            CARD16 level, want = state == POWER_OFF ? DPMSModeOff : DPMSModeStandby;
+            BOOL enabled;
+            DPMSInfo(dpy, &level, &enabled);
+            if (level != want)
+                DPMSForceLevel(dpy, want);
+        }
+        XFlush(dpy);
+    }
+
+    power.state = state;
+    TRACE_INSTANT("power", state);
+}
+
+/*
+ * Input arrived. The servers power the displays up by themselves, only the
+ * lock windows have to be shown again. Returns True when the canvases need
+ * a redraw.
+ *
+ */
+static Bool
+power_wake(void) {
+    power.last_input = monotonic_ms();
+    power.requested = POWER_ACTIVE;
+    if (power.state == POWER_ACTIVE)
+        return False;
+
+    for (int i = 0; i < ndisplays; i++) {
+        LockDisplay *d = &displays[i];
+        display_use(d);
+        for (int n = 0; n < d->nscreens; n++) {
+            LockScreen *s = &d->screens[n];
+            if (s->backdrop.pixmap != None)
+                XSetWindowBackgroundPixmap(dpy, s->win, s->backdrop.pixmap);
+            else
+                XSetWindowBackground(dpy, s->win, s->background.pixel);
+            XClearWindow(dpy, s->win);
+        }
+    }
+    power.state = POWER_ACTIVE;
+    return True;
+}
+
+/*
+ * Powers the display down soon, whatever the timeouts.
+ *
+ */
+static void
+power_request(PowerState state) {
+    if (state >= POWER_STANDBY && !power.dpms)
+        state = POWER_DIMMED;
+    power.requested = state;
+    power.requested_at = monotonic_ms() + POWER_SETTLE;
+}
+
+/*
+ * When a state is entered without further input, UINT64_MAX for never.
+ *
+ */
+static uint64_t
+power_deadline(PowerState state) {
+    uint64_t at = UINT64_MAX;
+    if (power.timeouts[state] && (state < POWER_STANDBY || power.dpms))
+        at = power.last_input + (uint64_t)power.timeouts[state] * 1000;
+    if (power.requested >= state)
+        at = MIN(at, power.requested_at);
+    return at;
+}
+
+/*
+ * Enters the deepest state whose time has come. Returns the poll() timeout
+ * until the next transition, -1 when there is none.
+ *
+ */
+static int
+power_timeout(void) {
+    uint64_t now = monotonic_ms();
+
+    PowerState due = power.state;
+    for (PowerState s = power.state + 1; s < POWER_STATE_COUNT; s++)
+        if (power_deadline(s) <= now)
+            due = s;
+    if (due != power.state)
+        power_enter(due);
+
+    uint64_t next = UINT64_MAX;
+    for (PowerState s = power.state + 1; s < POWER_STATE_COUNT; s++)
+        next = MIN(next, power_deadline(s));
+    if (next == UINT64_MAX)
+        return -1;
+    return (int)MIN(next - now, INT_MAX);
+}
+
+/*
+ * Sets up one canvas per output of a screen, laid out again when its CRTC
+ * changes. They live as long as the window, a daemon keeps them between
+ * locks.
+ *
+ */
+static void
+canvases_init(LockScreen *s, const char* username) {
+    X11Canvas *canvases = s->canvases;
+    WindowPositionInfo *info = &s->info;
+
+    memset(canvases, 0, sizeof(X11Canvas) * MAX_OUTPUTS);
+    for (int i = 0; i < MAX_OUTPUTS; i++) {
+        X11Canvas *x11 = &canvases[i];
+
+        x11->canvas.backend = &x11_backend;
+        x11->canvas.buffered = opt_render == RENDER_PIXMAP;
+        x11->canvas.ascent = s->face.ascent;
+        x11->canvas.descent = s->face.descent;
+        x11->canvas.text_color = s->text_color.pixel;
+        x11->win = s->win;
+        x11->back = None;
+        x11->gc = s->gc;
+        x11->face = &s->face;
+        x11->target = s->win;
+        x11->tile = s->backdrop.pixmap;
+        x11->background = s->background.pixel;
+        x11->foreground = s->text_color.pixel;
+        widget_set(&x11->canvas, WIDGET_USERNAME, username, strlen(username), s->text_color.pixel);
+
+        if (i < info->noutputs) {
+            x11_set_target(x11, s->win);
+            output_layout(s, i);
+        }
+    }
+}
+
+/*
+ * Handles an event for the lock window of a screen: exposures, an obscured
+ * window is raised, RandR screen and CRTC changes are followed whether
+ * locked or not. Returns True if the event was consumed.
+ *
+ */
+static Bool
+screen_handle_event(LockScreen *s, XEvent *event) {
+    WindowPositionInfo *info = &s->info;
+
+    if (event->type == Expose) {
+        for (int i = 0; i < info->noutputs; i++)
+            if (!s->canvases[i].clone)
+                canvas_expose(&s->canvases[i].canvas, event->xexpose.x, event->xexpose.y,
+                        event->xexpose.width, event->xexpose.height, event->xexpose.count);
+        return True;
+    }
+    if (event->type == VisibilityNotify) {
+        if (event->xvisibility.state != VisibilityUnobscured)
+            XRaiseWindow(dpy, s->win);
+        return True;
+    }
+
+    if (info->rr_event_base == -1)
+        return False;
+
+    if (event->type == info->rr_event_base + RRScreenChangeNotify) {
+        uint64_t trace = TRACE_START();
+        /* follow the new screen size, outputs report their own changes */
+        XRRUpdateConfiguration(event);
+        int width = DisplayWidth(dpy, s->num);
+        int height = DisplayHeight(dpy, s->num);
+        if (width != info->display_width || height != info->display_height) {
+            info->display_width = width;
+            info->display_height = height;
+            XResizeWindow(dpy, s->win, width, height);
+            wallpaper_resize(s);
+        }
+        TRACE_SPAN("randr_screen_change", trace, width);
+        return True;
+    }
+    if (event->type == info->rr_event_base + RRNotify &&
+            ((XRRNotifyEvent *)event)->subtype == RRNotify_CrtcChange) {
+        uint64_t trace = TRACE_START();
+        output_crtc_changed(s, (XRRCrtcChangeNotifyEvent *)event);
+        TRACE_SPAN("randr_crtc_change", trace, info->noutputs);
+        return True;
+    }
+    return False;
+}
+
+/*
+ * Passes an event to the screen whose lock window it was sent to. Returns
+ * True if the event was consumed.
+ *
+ */
+static Bool
+display_handle_event(LockDisplay *d, XEvent *event) {
+    for (int n = 0; n < d->nscreens; n++)
+        if (event->xany.window == d->screens[n].win)
+            return screen_handle_event(&d->screens[n], event);
+    return False;
+}
+
+/*
+ * The lock is on screen, or the displays are powered down: a suspend held
+ * off for it may go on. Whatever was sent has been drawn once the servers
+ * answered. The latency is checked against how long logind waits at most.
+ *
+ */
+static void
+sleep_locked(void) {
+    if (!sleep_lock.pending)
+        return;
+
+    for (int i = 0; i < ndisplays; i++) {
+        display_use(&displays[i]);
+        XSync(dpy, False);
+    }
+    logind_release();
+    sleep_lock.pending = False;
+
+    uint64_t latency = stats_now() - sleep_lock.since;
+    uint64_t budget = logind_budget();
+    TRACE_INSTANT("sleep_lock", latency);
+    if (stats_enabled)
+        stats_record(STATS_SLEEP_LOCK, latency);
+    if (budget && latency > budget)
+        fprintf(stderr, "Warning: locking before suspend took %llu ms, logind waits %llu ms at most.\n",
+                (unsigned long long)latency / 1000, (unsigned long long)budget / 1000);
+}
+
+/*
+ * Redraws every screen of a display whose vblank has come. The password
+ * line is the same everywhere, the info line shows the display's keyboard
+ * layout. Returns True when a screen was ready for a frame.
+ *
+ */
+static Bool
+display_render(LockDisplay *d, const char *pass_text, int pass_len, Bool pass_error) {
+    Keyboard *keyboard = &d->keyboard;
+    Bool drawn = False;
+
+    /* layout name and capslock state, from the cache */
+    if (keyboard->stale)
+        keyboard_load_layouts(keyboard);
+    const char *layout = keyboard->ngroups > keyboard->group ? keyboard->groups[keyboard->group] : NULL;
+    PromptFrame frame = {
+        .pass = pass_text, .pass_len = pass_len, .pass_error = pass_error,
+        .info = secrets->text, .caps = keyboard->caps,
+    };
+    frame.info_len = prompt_info(secrets->text, sizeof(secrets->text), secrets->datetime, layout, status_line);
+
+    for (int n = 0; n < d->nscreens; n++) {
+        LockScreen *s = &d->screens[n];
+        unsigned long request = NextRequest(dpy);
+
+        /* at most once per vblank */
+        if (!pacer_ready(&s->pacer))
+            continue;
+        drawn = True;
+
+        for (int i = 0; i < s->info.noutputs; i++) {
+            Canvas *canvas = &s->canvases[i].canvas;
+            if (s->canvases[i].clone)
+                continue;
+
+            prompt_frame(canvas, &frame, s->text_color.pixel, s->errmsg_color.pixel);
+            canvas_render(canvas);
+        }
+        if (NextRequest(dpy) != request)
+            pacer_frame(&s->pacer);
+    }
+    return drawn;
+}
+
+void
+main_loop(char passdisp[256], Bool hidelength, const char *username_pam) {
+    XEvent event;
+    KeySym ksym;
+    Prompt prompt;
+
+    Bool running = True;
+    Bool activity = False;
+
+    prompt_init(&prompt, secrets->password, sizeof(secrets->password));
+
+    const char *format = "%Y-%m-%d %H:%M";
+
+    /* KeyPress receipt times, waiting for the flush of their frame */
+    uint64_t key_times[64];
+    unsigned int nkeys = 0;
+
+    /* whatever the windows showed last time is gone */
+    for (int i = 0; i < ndisplays; i++) {
+        LockDisplay *d = &displays[i];
+        display_use(d);
+        XSync(dpy, False);
+        for (int n = 0; n < d->nscreens; n++) {
+            LockScreen *s = &d->screens[n];
+            for (int j = 0; j < s->info.noutputs; j++)
+                canvas_damage_all(&s->canvases[j].canvas);
+            s->pacer.waiting = False;
+        }
+    }
+    stats_roundtrips = 0;
+#ifdef STATS_ALLOCS
+    stats_allocs = 0;
+#endif
+
+    /* the clock is refreshed by a timer, not by incoming events */
+    char *datetime = secrets->datetime;
+    time_t t = time(NULL);
+    strftime(datetime, sizeof(secrets->datetime), format, localtime(&t));
+    int clock_fd = clock_create(format);
+
+    /* whatever the providers published while unlocked */
+    if (status_fd != -1)
+        status_read(status_line, sizeof(status_line));
+
+    /* the clock, the helper, the control socket, every connection, the
+     * status providers, then logind */
+    struct pollfd fds[7 + MAX_DISPLAYS];
+    fds[0].fd = clock_fd;
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+    for (int i = 0; i < ndisplays; i++) {
+        fds[5 + i].fd = ConnectionNumber(displays[i].dpy);
+        fds[5 + i].events = POLLIN;
+    }
+    fds[5 + ndisplays].fd = status_fd;
+    fds[5 + ndisplays].events = POLLIN;
+
+    /* main event loop */
+    while (running) {
+        /* handle everything Xlib has queued or can read without blocking on
+         * any display, the batch is drawn as one frame */
+        uint64_t trace = TRACE_START();
+        int nevents = 0;
+        for (int i = 0; running && i < ndisplays; i++) {
+            LockDisplay *d = &displays[i];
+            display_use(d);
+
+            while (running && XPending(dpy)) {
+                XNextEvent(dpy, &event);
+                nevents++;
+
+                if (event.type == d->keyboard.event_base) {
+                    keyboard_handle_event(&d->keyboard, &event);
+                    continue;
+                }
+
+                if (display_handle_event(d, &event))
+                    continue;
+
+                if (grab_handle_event(&d->grab, &event))
+                    continue;
+
+                /* already locked, only keep the idle alarm armed */
+                Bool idle_lock = False;
+                if (idle_handle_event(&d->idle, &event, &idle_lock))
+                    continue;
+
+#ifdef USE_XI
+                if (xi_handle_event(&d->xi, &event, &prompt))
+                    continue;
+#endif
+
+                /* a flood of motion is only activity */
+                if (event.type == MotionNotify) {
+                    activity = True;
+                    prompt_input(&prompt);
+                    continue;
+                }
+                if (event.type == ButtonPress)
+                    activity = True;
+
+                /* every display types into the same password */
+                if (event.type == KeyPress) {
+                    char inputChar = 0;
+                    PromptKey key = PROMPT_KEY_TEXT;
+                    activity = True;
+                    if (stats_enabled && nkeys < sizeof(key_times) / sizeof(key_times[0]))
+                        key_times[nkeys++] = stats_now();
+                    XLookupString(&event.xkey, &inputChar, sizeof(inputChar), &ksym, 0);
+
+                    if (ksym == XK_Return || ksym == XK_KP_Enter)
+                        key = PROMPT_KEY_SUBMIT;
+                    else if (ksym == XK_Escape)
+                        key = PROMPT_KEY_CANCEL;
+                    else if (ksym == XK_BackSpace)
+                        key = PROMPT_KEY_ERASE;
+
+                    switch (prompt_key(&prompt, key, inputChar, auth.pending)) {
+                        case PROMPT_SUBMIT:
+                            prompt_submitted(&prompt,
+                                    auth_submit(prompt.password, prompt.len, username_pam));
+                            break;
+                        case PROMPT_CANCEL:
+                            power_request(POWER_OFF);
+                            break;
+                        default:
+                            break;
+                    }
+                }
+            }
+        }
+
+        TRACE_SPAN("events", trace, nevents);
+
+        /* already locked, a suspend waits for the next frame; logind
+         * unlocking the session ends the lock like a password. Any process
+         * of the session's user may ask for that (loginctl unlock-session
+         * needs no authorization for one's own session), --logind trusts
+         * them all */
+        int session = logind_dispatch();
+        if (session & LOGIND_SLEEP) {
+            sleep_lock.pending = True;
+            sleep_lock.since = stats_now();
+        }
+        if (session & LOGIND_UNLOCK)
+            running = False;
 
-/* default command-line argument values */
-#define DEF_FONT              "-xos4-terminus-bold-r-normal--16-*"
-#define DEF_PASSCHAR          "*"
-#define DEF_BACKGROUND_COLOR  "#C3BfB0"
-#define DEF_TEXT_COLOR        "#423638"
-#define DEF_ERRMSG_COLOR      "#F80009"
+        if (!running)
+            break;
 
-typedef struct Dpms {
-    BOOL state;
-    CARD16 level;  // why?
-    CARD16 standby, suspend, off;
-} Dpms;
+        if (activity) {
+            activity = False;
+            if (power_wake())
+                for (int i = 0; i < ndisplays; i++)
+                    for (int n = 0; n < displays[i].nscreens; n++) {
+                        LockScreen *s = &displays[i].screens[n];
+                        for (int j = 0; j < s->info.noutputs; j++)
+                            canvas_damage_all(&s->canvases[j].canvas);
+                    }
+        }
 
-typedef struct WindowPositionInfo {
-    int display_width, display_height;
-    int output_x, output_y;
-    int output_width, output_height;
-} WindowPositionInfo;
+        /* update windows, no events pending, nothing to see while powered
+         * down */
+        if (power.state == POWER_ACTIVE) {
+            unsigned long requests = 0;
+            Bool drawn = False;
+            trace = TRACE_START();
+            const char *pass_text;
+            int pass_len;
+
+            /* without the clock timer, the clock is read for every frame */
+            if (clock_fd == -1) {
+                t = time(NULL);
+                strftime(datetime, sizeof(secrets->datetime), format, localtime(&t));
+            }
 
-static int conv_callback(int num_msgs, const struct pam_message **msg, struct pam_response **resp, void *appdata_ptr);
+            /* passdisp, 'authenticating' or 'auth failed' */
+            Bool pass_error = prompt_text(&prompt, auth.pending, passdisp, hidelength,
+                    &pass_text, &pass_len);
+
+            for (int i = 0; i < ndisplays; i++) {
+                display_use(&displays[i]);
+                unsigned long request = NextRequest(dpy);
+                if (display_render(&displays[i], pass_text, pass_len, pass_error))
+                    drawn = True;
+                XFlush(dpy);
+                requests += NextRequest(dpy) - request;
+            }
+            if (drawn)
+                TRACE_SPAN("frame", trace, requests);
+
+            if (stats_enabled && drawn) {
+                uint64_t now = stats_now();
+                for (unsigned int i = 0; i < nkeys; i++)
+                    stats_record(STATS_KEY_TO_FLUSH, now - key_times[i]);
+                nkeys = 0;
+                stats_record(STATS_FRAME_REQUESTS, requests);
+                stats_record(STATS_FRAME_ROUNDTRIPS, stats_roundtrips);
+                stats_roundtrips = 0;
+#ifdef STATS_ALLOCS
+                stats_record(STATS_FRAME_ALLOCS, stats_allocs);
+                stats_allocs = 0;
+#endif
+                stats_mark(STATS_FIRST_FRAME);
+            }
 
+            /* the lock is on screen */
+            if (drawn)
+                sleep_locked();
+        } else {
+            /* nothing to paint while powered down */
+            sleep_locked();
+        }
 
-/* command-line arguments */
-static char* opt_font;
-static char* opt_username;
-static char* opt_passchar;
-static char* opt_background_color;
-static char* opt_text_color;
-static char* opt_errmsg_color;
-static Bool  opt_hidelength;
-static Bool  opt_usedpms;
+        /* sleep until a server talks to us, the clock ticks, the
+         * authentication helper has a verdict, a lost grab is retried, the
+         * displays are to be powered down, a held back frame is due, a
+         * status provider has news or logind has something to say */
+        fds[1].fd = auth.pending ? auth.fd : -1;
+        control_fds(&fds[2]);
+        int timeout = power_timeout();
+        if (clock_fd == -1)
+            timeout = timeout_min(timeout, clock_timeout(clock_period(format)));
+        for (int i = 0; i < ndisplays; i++) {
+            LockDisplay *d = &displays[i];
+            display_use(d);
+            timeout = timeout_min(timeout, grab_timeout(&d->grab));
+#ifdef USE_XI
+            timeout = timeout_min(timeout, xi_timeout(&d->xi));
+#endif
+            for (int n = 0; n < d->nscreens; n++)
+                timeout = timeout_min(timeout, pacer_timeout(&d->screens[n].pacer));
+            XFlush(dpy);
+        }
+        timeout = timeout_min(timeout, logind_timeout());
+        logind_pollfd(&fds[6 + ndisplays]);
+        trace = TRACE_START();
+        int ready = poll(fds, 7 + ndisplays, timeout);
+        TRACE_SPAN("poll", trace, timeout);
+        if (ready == -1 && errno != EINTR)
+            die("poll: %s\n", strerror(errno));
+        if (ready == -1 || (fds[3].revents & POLLIN))
+            signals_run();
+        if (exit_requested)
+            break;
+        if (ready == -1)
+            continue;
 
-/* need globals for signal handling */
-Display *dpy;
-Dpms dpms_original = { .state = True, .level = 0, .standby = 600, .suspend = 600, .off = 600 };  // holds original values
-int dpms_timeout = 10;  // dpms timeout until program exits
-Bool using_dpms;
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            int ret = auth_read_verdict();
+            if (ret != -1) {
+                switch (prompt_verdict(&prompt, ret == PAM_SUCCESS)) {
+                    case PROMPT_UNLOCK:
+                        running = False;
+                        break;
+                    case PROMPT_SUBMIT:
+                        prompt_submitted(&prompt,
+                                auth_submit(prompt.password, prompt.len, username_pam));
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
 
-pam_handle_t *pam_handle;
-struct pam_conv conv = { conv_callback, NULL };
+        /* already locked, tell whoever asks */
+        int client;
+        if (control_lock_requested(&fds[2], &client))
+            control_reply(client, "locked\n");
 
-/* Holds the password you enter */
-static char password[256];
+        if (fds[5 + ndisplays].revents & POLLIN) {
+            status_ack();
+            status_read(status_line, sizeof(status_line));
+        }
 
+        if (fds[0].revents & POLLIN) {
+            uint64_t expirations;
+            /* fails with ECANCELED when the system clock was set */
+            if (read(clock_fd, &expirations, sizeof(expirations)) == -1 && errno == ECANCELED)
+                clock_arm(clock_fd, clock_period(format));
+            t = time(NULL);
+            strftime(datetime, sizeof(secrets->datetime), format, localtime(&t));
+        }
+    }
 
-static void
-die(const char *errstr, ...) {
-    va_list ap;
-    va_start(ap, errstr);
-    fprintf(stderr, "%s: ", PROGNAME);
-    vfprintf(stderr, errstr, ap);
-    va_end(ap);
-    exit(EXIT_FAILURE);
+    if (clock_fd != -1)
+        close(clock_fd);
 }
 
 /*
- * Clears the memory which stored the password to be a bit safer against
- * cold-boot attacks.
+ * Gives the grabs back and hides the windows of a display.
  *
  */
 static void
-clear_password_memory(void) {
-    /* A volatile pointer to the password buffer to prevent the compiler from
-     * optimizing this out. */
-    volatile char *vpassword = password;
-    for (unsigned int c = 0; c < sizeof(password); c++)
-        /* rewrite with random values */
-        vpassword[c] = rand();
+lock_release(LockDisplay *d) {
+    display_use(d);
+    grab_release(&d->grab);
+    XSelectInput(dpy, d->grab.root, NoEventMask);
+    for (int n = 0; n < d->nscreens; n++)
+        XUnmapWindow(dpy, d->screens[n].win);
+    XSync(dpy, False);
 }
 
 /*
- * Callback function for PAM. We only react on password request callbacks.
+ * Idle state of the daemon: the windows are unmapped, the caches follow
+ * RandR and XKB changes on every display. Returns when a lock is asked for,
+ * with the client waiting for the answer or -1, when the user was inactive
+ * for too long, or when a signal set exit_requested.
  *
  */
 static int
-conv_callback(int num_msgs, const struct pam_message **msg, struct pam_response **resp, void *UNUSED(appdata_ptr)) {
-    if (num_msgs == 0)
-        return PAM_BUF_ERR;
+daemon_wait(void) {
+    XEvent event;
+    struct pollfd fds[4 + MAX_DISPLAYS];
+    int client;
+    Bool idle_lock = False;
 
-    // PAM expects an array of responses, one for each message
-    if ((*resp = calloc(num_msgs, sizeof(struct pam_message))) == NULL)
-        return PAM_BUF_ERR;
+    for (int i = 0; i < ndisplays; i++) {
+        fds[3 + i].fd = ConnectionNumber(displays[i].dpy);
+        fds[3 + i].events = POLLIN;
+    }
 
-    for (int i = 0; i < num_msgs; i++) {
-        if (msg[i]->msg_style != PAM_PROMPT_ECHO_OFF &&
-            msg[i]->msg_style != PAM_PROMPT_ECHO_ON)
+    for (;;) {
+        for (int i = 0; i < ndisplays; i++) {
+            LockDisplay *d = &displays[i];
+            display_use(d);
+            while (XPending(dpy)) {
+                XNextEvent(dpy, &event);
+                if (event.type == d->keyboard.event_base) {
+                    keyboard_handle_event(&d->keyboard, &event);
+                    continue;
+                }
+                if (display_handle_event(d, &event))
+                    continue;
+                idle_handle_event(&d->idle, &event, &idle_lock);
+            }
+            XFlush(dpy);
+        }
+        if (idle_lock)
+            return -1;
+
+        /* a suspend or lock-session locks right away */
+        int session = logind_dispatch();
+        if (session & LOGIND_SLEEP) {
+            sleep_lock.pending = True;
+            sleep_lock.since = stats_now();
+        }
+        if (session & (LOGIND_SLEEP | LOGIND_LOCK))
+            return -1;
+
+        control_fds(&fds[0]);
+        logind_pollfd(&fds[3 + ndisplays]);
+        int ready = poll(fds, 4 + ndisplays, logind_timeout());
+        if (ready == -1 && errno != EINTR)
+            die("poll: %s\n", strerror(errno));
+        if (ready == -1 || (fds[1].revents & POLLIN))
+            signals_run();
+        if (exit_requested)
+            return -1;
+        if (ready == -1)
             continue;
 
-        // return code is currently not used but should be set to zero
-        resp[i]->resp_retcode = 0;
-        if ((resp[i]->resp = strdup(password)) == NULL) {
-            free(*resp);
-            return PAM_BUF_ERR;
-        }
+        if (control_lock_requested(&fds[0], &client))
+            return client;
     }
-
-    return PAM_SUCCESS;
 }
 
-void
-handle_signal(int sig) {
-    /* restore dpms settings */
-    if (using_dpms) {
-        DPMSSetTimeouts(dpy, dpms_original.standby, dpms_original.suspend, dpms_original.off);
-        if (!dpms_original.state)
-            DPMSDisable(dpy);
+/*
+ * Maps the windows of a display over everything and takes the grabs. The
+ * windows are unmapped again when they can not be had.
+ *
+ */
+static Bool
+lock_acquire(LockDisplay *d) {
+    display_use(d);
+
+    /* the desktop as it is right now, before the windows cover it */
+    if (wallpaper.blur)
+        for (int n = 0; n < d->nscreens; n++)
+            wallpaper_capture(&d->screens[n]);
+
+    /* lost keyboard grabs show up as FocusOut on the grab window */
+    XSelectInput(dpy, d->grab.root, FocusChangeMask);
+    for (int n = 0; n < d->nscreens; n++)
+        XMapRaised(dpy, d->screens[n].win);
+    stats_mark(STATS_MAP);
+
+    if (grab_acquire(&d->grab, opt_grab_timeout)) {
+#ifdef USE_XI
+        if (d->xi.opcode != -1)
+            xi_select_motion(&d->xi, True);
+#endif
+        return True;
     }
 
-    die("Caught signal %d; dying\n", sig);
+    lock_release(d);
+    return False;
 }
 
-void
-main_loop(Window w, GC gc, XFontStruct* font, WindowPositionInfo* info, char passdisp[256], char* username, XColor UNUSED(background), XColor text_color, XColor errmsg_color, Bool hidelength, char **layoutGroups, int groupSize) {
-    XEvent event;
-    KeySym ksym;
 
-    unsigned int len = 0;
-    Bool running = True;
-    Bool sleepmode = False;
-    Bool failed = False;
+/*
+ * Measures the text, creates the lock window of a screen with everything
+ * drawn on it. The font is loaded by the caller.
+ *
+ */
+static void
+screen_init(LockScreen *s, const Startup *st, char passdisp[256]) {
+    /* measure everything with a width known in advance */
+    typeface_add_color(&s->face, &s->text_color);
+    typeface_add_color(&s->face, &s->errmsg_color);
+    if (!s->face.borrowed) {
+        typeface_cache_run(&s->face, prompt_authenticating, strlen(prompt_authenticating));
+        typeface_cache_run(&s->face, prompt_failed, strlen(prompt_failed));
+        typeface_cache_run(&s->face, prompt_caps, strlen(prompt_caps));
+        typeface_cache_run(&s->face, opt_username, strlen(opt_username));
+        typeface_cache_mask(&s->face, passdisp, 256);
+    }
 
-    char datetime[] = "YYYY-MM-DD HH:MM";
-    int datelen=strlen(datetime);
-    char *format = "%Y-%m-%d %H:%M";
-    char sep[] = " | ";
-    time_t t = time(0);
-    int line_gap = 20;
+    /* scale the background image once, the server repaints from it */
+    wallpaper_create(s);
 
-    XSync(dpy, False);
+    /* create window */
+    {
+        XSetWindowAttributes wa;
+        unsigned long mask = CWOverrideRedirect | CWEventMask;
+        wa.override_redirect = 1;
+        if (s->backdrop.pixmap != None) {
+            wa.background_pixmap = s->backdrop.pixmap;
+            mask |= CWBackPixmap;
+        } else {
+            wa.background_pixel = s->background.pixel;
+            mask |= CWBackPixel;
+        }
+        wa.event_mask = ExposureMask | VisibilityChangeMask | EnterWindowMask | LeaveWindowMask;
+        s->win = XCreateWindow(dpy, s->root, 0, 0, s->info.display_width, s->info.display_height,
+                0, DefaultDepth(dpy, s->num), CopyFromParent,
+                DefaultVisual(dpy, s->num), mask, &wa);
+
+        /* re-layout on hotplug and resolution changes */
+        if (s->info.rr_event_base != -1)
+            XRRSelectInput(dpy, s->win, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+    }
+
+    /* define cursor */
+    {
+        char curs[] = {0, 0, 0, 0, 0, 0, 0, 0};
+        Pixmap pmap = XCreateBitmapFromData(dpy, s->win, curs, 8, 8);
+        s->cursor = XCreatePixmapCursor(dpy, pmap, pmap, &s->background, &s->background, 0, 0);
+        XDefineCursor(dpy, s->win, s->cursor);
+        XFreePixmap(dpy, pmap);
+    }
+
+    /* create Graphics Context */
+    {
+        XGCValues values;
+        /* XCopyArea from the back buffer must not generate NoExpose events */
+        values.graphics_exposures = False;
+        s->gc = XCreateGC(dpy, s->win, GCGraphicsExposures, &values);
+        if (s->face.core)
+            XSetFont(dpy, s->gc, s->face.core->fid);
+        XSetForeground(dpy, s->gc, s->text_color.pixel);
+    }
 
-    /* define base coordinates - middle of screen */
-    int base_x = info->output_x + info->output_width / 2;
-    int base_y = info->output_y + info->output_height / 2;    /* y-position of the line */
+    canvases_init(s, opt_username);
+    pacer_init(&s->pacer, st->c, st->have_present, s->win);
+}
+
+/*
+ * Connects to a display and sets up every screen of it. The requests of all
+ * screens share the startup waves, so more screens cost no more round trips.
+ *
+ */
+static void
+display_open(LockDisplay *d, const char *name, char passdisp[256]) {
+    memset(d, 0, sizeof(*d));
+    d->name = name;
+    d->shm = -1;
+    if (!(d->dpy = XOpenDisplay(name)))
+        die("cannot open dpy %s\n", XDisplayName(name));
+    display_use(d);
+
+    if ((d->nscreens = ScreenCount(dpy)) > MAX_SCREENS) {
+        fprintf(stderr, "Warning: only the first %d screens of %s are locked.\n", MAX_SCREENS, DisplayString(dpy));
+        d->nscreens = MAX_SCREENS;
+    }
+    if (!(d->screens = calloc(d->nscreens, sizeof(LockScreen))))
+        die("out of memory\n");
+    for (int n = 0; n < d->nscreens; n++) {
+        d->screens[n].display = d;
+        d->screens[n].num = n;
+        d->screens[n].root = RootWindow(dpy, n);
+    }
 
-    /* not changed in the loop */
-    int line_x_left = base_x - info->output_width / 8;
-    int line_x_right = base_x + info->output_width / 8;
+    /* fonts and colors resolved by a previous run with this server and options */
+    ResourceCache resources;
+    char resources_path[PATH_MAX];
+    Bool resources_hit = resources_load(&resources, resources_path, sizeof(resources_path));
 
-    /* font properties */
-    int ascent, descent;
+    /* send every independent request up front, replies are collected below */
+    Startup startup;
     {
-        int dir;
-        XCharStruct overall;
-        XTextExtents(font, passdisp, strlen(username), &dir, &ascent, &descent, &overall);
+        const char *specs[COLOR_COUNT] = {
+            [COLOR_BACKGROUND] = opt_background_color,
+            [COLOR_TEXT] = opt_text_color,
+            [COLOR_ERRMSG] = opt_errmsg_color,
+        };
+        startup_begin(&startup, d->nscreens, specs, resources_hit ? &resources : NULL);
     }
 
-    /* main event loop */
-    while(running && !XNextEvent(dpy, &event)) {
-        if (sleepmode && using_dpms)
-            DPMSForceLevel(dpy, DPMSModeOff);
-
-        /* update window if no events pending */
-        if (!XPending(dpy)) {
-            int x;
-            /* draw username and line */
-            x = base_x - XTextWidth(font, username, strlen(username)) / 2;
-            XDrawString(dpy, w, gc, x, base_y - (line_gap/2) - descent, username, strlen(username));
-            XDrawLine(dpy, w, gc, line_x_left, base_y, line_x_right, base_y);
-
-            /* clear old passdisp */
-            XClearArea(dpy, w, info->output_x, base_y + line_gap, info->output_width, ascent + descent, False);
-
-            /* draw new passdisp or 'auth failed' */
-            if (failed) {
-                x = base_x - XTextWidth(font, "authentication failed", 21) / 2;
-                XSetForeground(dpy, gc, errmsg_color.pixel);
-                XDrawString(dpy, w, gc, x, base_y + ascent + line_gap, "authentication failed", 21);
-                XSetForeground(dpy, gc, text_color.pixel);
-            } else {
-                int lendisp = len;
-                if (hidelength && len > 0)
-                    lendisp += (passdisp[len] * len) % 5;
-                x = base_x - XTextWidth(font, passdisp, lendisp) / 2;
-                XDrawString(dpy, w, gc, x, base_y + ascent + line_gap, passdisp, lendisp % 256);
-            }
+    /* Xlib waits for the font while the first wave is in flight. A font
+     * resolved by a previous run is opened by its full name, the server does
+     * not match the pattern against its font path again. */
+    Typeface *face = &d->screens[0].face;
+    Bool font_cached = resources_hit && resources.font[0] && !opt_xftfont &&
+        startup_font_path(&startup) == resources.font_path &&
+        typeface_load(face, 0, resources.font, NULL);
+    if (!font_cached && !typeface_load(face, 0, opt_font, opt_xftfont))
+        die("error: could not find font. Try using a full description.\n");
 
-            char *text;
+    startup_send_queries(&startup);
 
-            /* get time */
-            t = time(NULL);
-            memset(datetime, 0, datelen);
-            strftime(datetime, datelen+1, format, localtime(&t));
-
-            /* get layout name */
-            int currentGroup;
-            {
-                XkbStateRec xkbState;
-                XkbGetState(dpy, XkbUseCoreKbd, &xkbState);
-                currentGroup = (int)(xkbState.group);
-            }
-            if (groupSize > currentGroup){
-                size_t txtLen = strlen(datetime) + strlen(sep) + strlen(layoutGroups[currentGroup]) + sizeof(char);
-                text = (char*)malloc(sizeof(char) * txtLen);
-                strcpy(text, datetime);
-                strcat(text, sep);
-                strcat(text, layoutGroups[currentGroup]);
-            }else{
-                text = (char*)malloc(sizeof(char) * strlen(datetime) + sizeof(char));
-                strcpy(text, datetime);
-            }
+    /* allocate colors */
+    for (int n = 0; n < d->nscreens; n++) {
+        LockScreen *s = &d->screens[n];
+        XColor colors[COLOR_COUNT];
+        startup_collect_colors(&startup, n, colors);
+        s->background = colors[COLOR_BACKGROUND];
+        s->text_color = colors[COLOR_TEXT];
+        s->errmsg_color = colors[COLOR_ERRMSG];
+    }
 
-            /* write text */
-            /* font properties */
-            // http://filonenko-mikhail.github.io/clx-truetype/ttf-metrics.png
-            int height = ascent + descent;
-            int width = XTextWidth(font, text, strlen(text));
-            x = base_x - width / 2;
-            // base_y the middle of the screen. height*2 because
-            // we pass two lines: username and line of date (get left up of corner of text)
-            // line+gap*1.5: 0.5 line gap between username and line and 1 line gap between date and username
-            XClearArea(dpy, w, x, base_y - (line_gap*1.5) - (height*2), width, height, False);
-            XDrawString(dpy, w, gc, x, base_y - (line_gap*1.5) - height - descent, text, strlen(text));
-            free(text);
-
-            /* Check capslock state */
-            unsigned int state;
-            char caps[] = "Caps lock is on";
-            size_t capsLen = strlen(caps);
-            XkbGetIndicatorState (dpy, XkbUseCoreKbd, &state);
-            width = XTextWidth(font, caps, capsLen);
-            x = base_x - width / 2;
-            XClearArea(dpy, w, x, base_y + (line_gap*2) + height, width, height, False);
-            if (state & 1){
-                XSetForeground(dpy, gc, errmsg_color.pixel);
-                XDrawString(dpy, w, gc, x, base_y + (line_gap*2) + height + ascent, caps, capsLen);
-                XSetForeground(dpy, gc, text_color.pixel);
-            }
+    /* remember what was resolved, a stale entry is replaced */
+    if (!resources_hit || (!font_cached && !opt_xftfont)) {
+        resources.ncolors = COLOR_COUNT;
+        for (int i = 0; i < COLOR_COUNT; i++) {
+            resources.colors[i].red = startup.screens[0].colors[i].parsed.red;
+            resources.colors[i].green = startup.screens[0].colors[i].parsed.green;
+            resources.colors[i].blue = startup.screens[0].colors[i].parsed.blue;
         }
+        resources.font_path = startup_font_path(&startup);
+        typeface_resolved_name(face, resources.font, sizeof(resources.font));
+        resources_store(&resources, resources_path);
+    }
 
-        /* draw date, time, keyboard layout, capslock state */
-        if (event.type == MotionNotify || event.type == KeyPress) {
-            sleepmode = False;
-            failed = False;
-        }
+    /* Xlib needs RandR for its events, asked while the second wave is in flight */
+    int rr_event_base, error_base;
+    if (!XRRQueryExtension(dpy, &rr_event_base, &error_base))
+        rr_event_base = -1;
 
-        if (event.type == KeyPress) {
-            char inputChar = 0;
-            XLookupString(&event.xkey, &inputChar, sizeof(inputChar), &ksym, 0);
+    /* get keyboard layouts and state */
+    keyboard_init(&d->keyboard);
 
-            switch (ksym) {
-                case XK_Return:
-                case XK_KP_Enter:
-                    password[len] = 0;
-                    if (pam_authenticate(pam_handle, 0) == PAM_SUCCESS) {
-                        clear_password_memory();
-                        running = False;
-                    } else {
-                        failed = True;
-                    }
-                    len = 0;
-                    break;
-                case XK_Escape:
-                    len = 0;
-                    sleepmode = True;
-                    break;
-                case XK_BackSpace:
-                    if (len)
-                        --len;
-                    break;
-                default:
-                    if (isprint(inputChar) && (len + sizeof(inputChar) < sizeof password)) {
-                        memcpy(password + len, &inputChar, sizeof(inputChar));
-                        len += sizeof(inputChar);
-                    }
-                    break;
-            }
+#ifdef USE_XI
+    d->xi.opcode = -1;
+    if (opt_xinput2) {
+        xi_init(&d->xi, d->screens[0].root);
+        d->grab.xi = &d->xi;
+    }
+#endif
+
+    /* get the size of every screen and the position of every active output */
+    for (int n = 0; n < d->nscreens; n++) {
+        WindowPositionInfo *info = &d->screens[n].info;
+        info->rr_event_base = rr_event_base;
+        info->display_width = DisplayWidth(dpy, n);
+        info->display_height = DisplayHeight(dpy, n);
+    }
+    startup_finish(&startup, d);
+
+    for (int n = 0; n < d->nscreens; n++) {
+        LockScreen *s = &d->screens[n];
+        WindowPositionInfo *info = &s->info;
+
+        /* no usable RandR information, center on the whole screen */
+        if (info->noutputs == 0) {
+            fprintf(stderr, "Warning: no active output detected on screen %d, using the whole screen.\n", n);
+            info->outputs[0].crtc = None;
+            info->outputs[0].x = 0;
+            info->outputs[0].y = 0;
+            info->outputs[0].width = info->display_width;
+            info->outputs[0].height = info->display_height;
+            info->noutputs = 1;
+        }
+
+        /* a core font serves every screen, Xft fonts belong to one */
+        if (n > 0 && d->screens[0].face.core) {
+            s->face = d->screens[0].face;
+            s->face.screen = n;
+            s->face.borrowed = True;
+        } else if (n > 0 && !typeface_load(&s->face, n, opt_font, opt_xftfont)) {
+            die("error: could not find font. Try using a full description.\n");
         }
+
+        screen_init(s, &startup, passdisp);
     }
+
+    /* the keyboard and the pointer are grabbed on the first screen */
+    d->grab.root = d->screens[0].root;
+    d->grab.win = d->screens[0].win;
+    d->grab.cursor = d->screens[0].cursor;
+
+    d->idle.event_base = -1;
+    if (opt_idle_lock)
+        idle_init(&d->idle, opt_idle_lock);
 }
 
+static void
+display_close(LockDisplay *d) {
+    display_use(d);
+    idle_free(&d->idle);
+
+    for (int n = 0; n < d->nscreens; n++) {
+        LockScreen *s = &d->screens[n];
+        pacer_free(&s->pacer);
+        for (int i = 0; i < s->info.noutputs; i++)
+            x11_canvas_free(&s->canvases[i]);
+        typeface_free(&s->face);
+        wallpaper_free(s);
+        XFreeGC(dpy, s->gc);
+        XDestroyWindow(dpy, s->win);
+    }
+    free(d->screens);
+    free(d->keyboard.layout);
+    XCloseDisplay(dpy);
+    d->dpy = NULL;
+}
 
 Bool
 parse_options(int argc, char** argv)
@@ -352,11 +3600,25 @@ parse_options(int argc, char** argv)
         { "nodpms",           no_argument,       0, 'd' },
         { "hidelength",       no_argument,       0, 'l' },
         { "font",             required_argument, 0, 'f' },
+        { "xftfont",          required_argument, 0, XFTFONT_KEY },
         { "passchar",         required_argument, 0, 'p' },
         { "username",         required_argument, 0, 'u' },
         { "background-color", required_argument, 0, BACKGROUND_COLOR_KEY },
         { "text-color",       required_argument, 0, TEXT_COLOR_KEY },
         { "errmsg-color",     required_argument, 0, ERRMSG_COLOR_KEY },
+        { "render",           required_argument, 0, RENDER_KEY },
+        { "stats",            optional_argument, 0, STATS_KEY },
+        { "grab-timeout",     required_argument, 0, GRAB_TIMEOUT_KEY },
+        { "daemon",           optional_argument, 0, DAEMON_KEY },
+        { "idle-lock",        required_argument, 0, IDLE_LOCK_KEY },
+        { "background-image", required_argument, 0, BACKGROUND_IMAGE_KEY },
+        { "blur",             required_argument, 0, BLUR_KEY },
+        { "dpms",             required_argument, 0, DPMS_KEY },
+        { "trace",            required_argument, 0, TRACE_KEY },
+        { "display",          required_argument, 0, DISPLAY_KEY },
+        { "xinput2",          no_argument,       0, XINPUT2_KEY },
+        { "status",           required_argument, 0, STATUS_KEY },
+        { "logind",           no_argument,       0, LOGIND_KEY },
         { 0, 0, 0, 0 },
     };
 
@@ -373,24 +3635,59 @@ parse_options(int argc, char** argv)
                     "Mandatory arguments to long options are mandatory for short options too.\n"
                     "   -h, --help              show this help page and exit\n"
                     "   -v, --version           show version info and exit\n"
+                    "       --display=DISPLAY   lock this X display, every screen of it; repeat to\n"
+                    "                             lock several (default: $DISPLAY)\n"
                     "   -d, --nodpms            do not handle DPMS\n"
+                    "       --dpms=DIM,STANDBY,OFF\n"
+                    "                           seconds without input until the lockscreen is\n"
+                    "                             blanked, the display is put in standby and\n"
+                    "                             turned off, 0 for never (default: %d,%d,%d)\n"
                     "   -l, --hidelength        derange the password length indicator\n"
                     "   -u, --username=USER     user name to be displayed at the lockscreen\n"
                     "                             (default: getenv(USER))\n"
                     "   -f, --font=XFONTDESC    use this font (expects X logical font description)\n"
                     "                             (default: \""DEF_FONT"\")\n"
+                    "       --xftfont=PATTERN   use an antialiased Xft font instead (fontconfig pattern,\n"
+                    "                             e.g. \"monospace:size=12\")\n"
                     "   -p, --passchar=C        characters used to obfuscate the password\n"
                     "                             (default: '"DEF_PASSCHAR"')\n"
                     "       --background-color=HEXCOLOR\n"
                     "                           background color for lockscreen in hex value\n"
                     "                             (default: \""DEF_BACKGROUND_COLOR"\")\n"
+                    "       --background-image=FILE\n"
+                    "                           background image (farbfeld, binary PPM or PNG),\n"
+                    "                             scaled to cover every output\n"
+                    "       --blur=RADIUS       show the desktop blurred with RADIUS (1-%d)\n"
                     "       --text-color=HEXCOLOR\n"
                     "                           text color for lockscreen in hex value\n"
                     "                             (default: \""DEF_TEXT_COLOR"\")\n"
                     "       --errmsg-color=HEXCOLOR\n"
                     "                           message color for autentification error in hex value\n"
                     "                             (default: \""DEF_ERRMSG_COLOR"\")\n"
-                );
+                    "       --render=direct|pixmap\n"
+                    "                           draw directly on the window, or into a back buffer\n"
+                    "                           copied to the window once per frame (default: pixmap)\n"
+                    "       --stats[=FILE]      record latencies and X request counts, print them\n"
+                    "                             to FILE (default: stderr) on exit and on SIGUSR1\n"
+                    "       --trace=FILE        record a trace of the last events, written to FILE\n"
+                    "                             on SIGUSR2 and on abnormal exit (needs a build\n"
+                    "                             with TRACE=1)\n"
+                    "       --grab-timeout=MS   give up when the keyboard and pointer can not be\n"
+                    "                             grabbed within MS milliseconds (default: %d)\n"
+                    "       --daemon[=SOCKET]   stay resident with everything set up, lock on a \"lock\"\n"
+                    "                             command on SOCKET or on SIGRTMIN (default:\n"
+                    "                             $XDG_RUNTIME_DIR/csxlock.socket)\n"
+                    "       --idle-lock=SECONDS stay resident and lock after SECONDS without input\n"
+                    "       --status=LIST       show more in the info line, comma separated: battery,\n"
+                    "                             network, notify[=SOCKET] (pending notifications,\n"
+                    "                             default: $XDG_RUNTIME_DIR/csxlock-notify.socket)\n"
+                    "       --xinput2           grab through XInput 2: pointer motion wakes csxlock\n"
+                    "                             at most once per frame, keys of another keyboard\n"
+                    "                             do not mix into the password being typed\n"
+                    "       --logind            stay resident, lock before suspend (which waits until\n"
+                    "                             the lock is on screen) and on lock-session, unlock\n"
+                    "                             on unlock-session (needs a build with LOGIND=1)\n"
+                    , DEF_DIM_TIMEOUT, DEF_STANDBY_TIMEOUT, DEF_OFF_TIMEOUT, BLUR_MAX_RADIUS, DEF_GRAB_TIMEOUT);
                 break;
             case 'v':
               die(PROGNAME "-" VERSION ", © 2020 Paweł Szynkiewicz\n");
@@ -424,6 +3721,81 @@ parse_options(int argc, char** argv)
             case ERRMSG_COLOR_KEY:
                 opt_errmsg_color = optarg;
                 break;
+            case XFTFONT_KEY:
+                opt_xftfont = optarg;
+                break;
+            case STATS_KEY:
+                opt_stats = optarg ? optarg : "";
+                break;
+            case TRACE_KEY:
+                opt_trace = optarg;
+                break;
+            case DISPLAY_KEY:
+                if (opt_ndisplays == MAX_DISPLAYS) {
+                    fprintf(stderr, "Warning: at most %d displays are locked, ignoring %s.\n", MAX_DISPLAYS, optarg);
+                    break;
+                }
+                opt_displays[opt_ndisplays++] = optarg;
+                break;
+            case DAEMON_KEY:
+                opt_daemon = optarg ? optarg : "";
+                break;
+            case LOGIND_KEY:
+                opt_logind = True;
+                break;
+            case STATUS_KEY:
+                opt_status = optarg;
+                break;
+            case XINPUT2_KEY:
+#ifdef USE_XI
+                opt_xinput2 = True;
+#else
+                fprintf(stderr, "Warning: built without XInput 2, ignoring --xinput2.\n");
+#endif
+                break;
+            case BLUR_KEY:
+                wallpaper.blur = atoi(optarg);
+                if (wallpaper.blur <= 0 || wallpaper.blur > BLUR_MAX_RADIUS) {
+                    fprintf(stderr, "Warning: blur radius must be 1-%d, not blurring.\n", BLUR_MAX_RADIUS);
+                    wallpaper.blur = 0;
+                }
+                break;
+            case DPMS_KEY: {
+                int dim, standby, off;
+                if (sscanf(optarg, "%d,%d,%d", &dim, &standby, &off) != 3 || dim < 0 || standby < 0 || off < 0) {
+                    fprintf(stderr, "Warning: invalid DPMS timeouts %s, using the defaults.\n", optarg);
+                    break;
+                }
+                power.timeouts[POWER_DIMMED] = dim;
+                power.timeouts[POWER_STANDBY] = standby;
+                power.timeouts[POWER_OFF] = off;
+                break;
+            }
+            case BACKGROUND_IMAGE_KEY:
+                wallpaper.path = optarg;
+                break;
+            case IDLE_LOCK_KEY:
+                opt_idle_lock = atoi(optarg);
+                if (opt_idle_lock <= 0) {
+                    fprintf(stderr, "Warning: invalid idle time %s, not locking on inactivity.\n", optarg);
+                    opt_idle_lock = 0;
+                }
+                break;
+            case GRAB_TIMEOUT_KEY:
+                opt_grab_timeout = atoi(optarg);
+                if (opt_grab_timeout <= 0) {
+                    fprintf(stderr, "Warning: invalid grab timeout %s, using the default.\n", optarg);
+                    opt_grab_timeout = DEF_GRAB_TIMEOUT;
+                }
+                break;
+            case RENDER_KEY:
+                if (strcmp(optarg, "direct") == 0)
+                    opt_render = RENDER_DIRECT;
+                else if (strcmp(optarg, "pixmap") == 0)
+                    opt_render = RENDER_PIXMAP;
+                else
+                    fprintf(stderr, "Warning: unknown render mode %s, using the default.\n", optarg);
+                break;
             default:
                 return False;
         }
@@ -435,14 +3807,6 @@ parse_options(int argc, char** argv)
 int
 main(int argc, char** argv) {
     char passdisp[256];
-    int screen_num;
-    WindowPositionInfo info;
-
-    Cursor invisible;
-    Window root, w;
-    XColor background, text_color, errmsg_color;
-    XFontStruct* font;
-    GC gc;
 
     /* get username (used for PAM authentication) */
     char* username;
@@ -452,9 +3816,14 @@ main(int argc, char** argv) {
     /* set default values for command-line arguments */
     opt_hidelength = False;
     opt_usedpms = True;
+    opt_xinput2 = False;
+    opt_logind = False;
+    opt_render = RENDER_PIXMAP;
+    opt_grab_timeout = DEF_GRAB_TIMEOUT;
 
     opt_username = username;
     opt_font = DEF_FONT;
+    opt_xftfont = NULL;
     opt_passchar = DEF_PASSCHAR;
 
     opt_background_color = DEF_BACKGROUND_COLOR;
@@ -464,223 +3833,182 @@ main(int argc, char** argv) {
     if (!parse_options(argc, argv))
         exit(EXIT_FAILURE);
 
+    /* the statistics file is opened with the user's identity, and kept */
+    if (opt_stats) {
+        privileges_drop();
+        if (stats_enable(*opt_stats ? opt_stats : NULL) == -1)
+            fprintf(stderr, "Warning: can not write statistics to %s: %s\n", opt_stats, strerror(errno));
+        privileges_restore();
+        stats_mark(STATS_START);
+    }
+
+    /* the trace file is written with the user's identity */
+    Bool tracing = False;
+    if (opt_trace) {
+        privileges_drop();
+        tracing = trace_enable(opt_trace) == 0;
+        int error = errno;
+        privileges_restore();
+        if (!tracing && error == ENOSYS)
+            fprintf(stderr, "Warning: built without tracing, ignoring --trace.\n");
+        else if (!tracing)
+            fprintf(stderr, "Warning: can not write trace to %s: %s\n", opt_trace, strerror(error));
+    }
+
     /* register signal handler function */
+    signals_open();
     if (signal (SIGINT, handle_signal) == SIG_IGN)
         signal (SIGINT, SIG_IGN);
     if (signal (SIGHUP, handle_signal) == SIG_IGN)
         signal (SIGHUP, SIG_IGN);
     if (signal (SIGTERM, handle_signal) == SIG_IGN)
         signal (SIGTERM, SIG_IGN);
+    if (stats_enabled)
+        signal (SIGUSR1, handle_stats_signal);
+    if (tracing)
+        signal (SIGUSR2, handle_trace_signal);
+
+    /* a daemon waits for a lock command on its socket, or for SIGRTMIN */
+    if (opt_daemon) {
+        char path[256];
+        if (*opt_daemon)
+            snprintf(path, sizeof(path), "%s", opt_daemon);
+        else if (getenv("XDG_RUNTIME_DIR"))
+            snprintf(path, sizeof(path), "%s/csxlock.socket", getenv("XDG_RUNTIME_DIR"));
+        else
+            snprintf(path, sizeof(path), "/tmp/csxlock-%d.socket", (int)getuid());
+        control_open(path);
+        signal (SIGRTMIN, handle_lock_signal);
+    }
 
     /* fill with password characters */
     for (unsigned int i = 0; i < sizeof(passdisp); i += strlen(opt_passchar))
         for (unsigned int j = 0; j < strlen(opt_passchar) && i + j < sizeof(passdisp); j++)
             passdisp[i + j] = opt_passchar[j];
 
-    /* initialize random number generator */
-    srand(time(NULL));
-
-    if (!(dpy = XOpenDisplay(NULL)))
-        die("cannot open dpy\n");
-
-    if (!(font = XLoadQueryFont(dpy, opt_font)))
-        die("error: could not find font. Try using a full description.\n");
-
-    screen_num = DefaultScreen(dpy);
-    root = DefaultRootWindow(dpy);
-
-    /* get display/output size and position */
-    {
-        XRRScreenResources* screen = NULL;
-        RROutput output;
-        XRROutputInfo* output_info = NULL;
-        XRRCrtcInfo* crtc_info = NULL;
-
-        screen = XRRGetScreenResources (dpy, root);
-        output = XRRGetOutputPrimary(dpy, root);
-
-        /* When there is no primary output, the return value of XRRGetOutputPrimary
-         * is undocumented, probably it is 0. Fall back to the first output in this
-         * case, connected state will be checked later.
-         */
-        if (output == 0) {
-            output = screen->outputs[0];
-        }
-        output_info = XRRGetOutputInfo(dpy, screen, output);
-
-        /* Iterate through screen->outputs until connected output is found. */
-        int i = 0;
-        while (output_info->connection != RR_Connected || output_info->crtc == 0) {
-            XRRFreeOutputInfo(output_info);
-            output_info = XRRGetOutputInfo(dpy, screen, screen->outputs[i]);
-            fprintf(stderr, "Warning: no primary output detected, trying %s.\n", output_info->name);
-            if (i == screen->noutput)
-                die("error: no connected output detected.\n");
-            i++;
-        }
+    /* Lock the area where we store the password in memory, we don’t want it to
+     * be swapped to disk. Since Linux 2.6.9, this does not require any
+     * privileges, just enough bytes in the RLIMIT_MEMLOCK limit. The helper
+     * inherits the arena. */
+    if (secure_init(sizeof(Secrets)) != 0 || !(secrets = secure_alloc(sizeof(Secrets))))
+        die("Could not lock page in memory, check RLIMIT_MEMLOCK\n");
 
-        crtc_info = XRRGetCrtcInfo (dpy, screen, output_info->crtc);
+    /* start PAM in the authentication helper, while we set up X */
+    auth_spawn(username);
 
-        info.output_x = crtc_info->x;
-        info.output_y = crtc_info->y;
-        info.output_width = crtc_info->width;
-        info.output_height = crtc_info->height;
-        info.display_width = DisplayWidth(dpy, screen_num);
-        info.display_height = DisplayHeight(dpy, screen_num);
+    /* the providers sample in threads of their own, started after the
+     * helper was forked */
+    if (opt_status)
+        status_fd = status_start(opt_status);
 
-        XRRFreeScreenResources(screen);
-        XRRFreeOutputInfo(output_info);
-        XRRFreeCrtcInfo(crtc_info);
+    /* every display given with --display, otherwise $DISPLAY */
+    if (opt_ndisplays == 0)
+        opt_displays[opt_ndisplays++] = NULL;
+    for (int i = 0; i < opt_ndisplays; i++) {
+        display_open(&displays[i], opt_displays[i], passdisp);
+        ndisplays++;
     }
 
-    /* allocate colors */
-    {
-        Colormap cmap = DefaultColormap(dpy, screen_num);
-        /* background */
-        if(!XParseColor(dpy, cmap, opt_background_color, &background)){
-            die("error: can not parse background color: %s\n", opt_background_color);
-        }else
-            XAllocColor(dpy, cmap, &background);
-        /* text_color */
-        if(!XParseColor(dpy, cmap, opt_text_color, &text_color)){
-            die("error: can not parse text color: %s\n", opt_text_color);
-        }else
-            XAllocColor(dpy, cmap, &text_color);
-        /* errmsg_color */
-        if(!XParseColor(dpy, cmap, opt_errmsg_color, &errmsg_color)){
-            die("error: can not parse color for unauthenticated error message: %s\n", opt_errmsg_color);
-        }else
-            XAllocColor(dpy, cmap, &errmsg_color);
-
-    }
-
-    /* get layout groups */
-    int tokenCount = 0;
-    char* layoutString = NULL;
-    {
-        XkbDescRec* kbdDescPtr = XkbAllocKeyboard();
-        XkbGetNames(dpy, XkbSymbolsNameMask, kbdDescPtr);
-        Atom symName = kbdDescPtr -> names -> symbols;
-        layoutString = XGetAtomName(dpy, symName);
-
-        char *tmp = layoutString;
-        while(*tmp != '\0' && *tmp != ':'){
-            if(*tmp == '+')
-                tokenCount ++;
-            tmp++;
-        }
-    }
-    char *layoutGroups[tokenCount];
-    {
-        strtok(layoutString, "+:"); //skip the first token, like 'pc'
-        for(int i=0; i<tokenCount; i++)
-            layoutGroups[i] = strtok(NULL, "+:");
+    /* suspends wait for the lock to be painted from now on */
+    if (opt_logind && logind_open() == -1) {
+        if (errno == ENOSYS)
+            die("built without logind support, --logind is not available\n");
+        die("can not connect to logind: %s\n", strerror(errno));
     }
 
-    /* create window */
-    {
-        XSetWindowAttributes wa;
-        wa.override_redirect = 1;
-        wa.background_pixel = background.pixel;
-        w = XCreateWindow(dpy, root, 0, 0, info.display_width, info.display_height,
-                0, DefaultDepth(dpy, screen_num), CopyFromParent,
-                DefaultVisual(dpy, screen_num), CWOverrideRedirect | CWBackPixel, &wa);
-        XMapRaised(dpy, w);
-    }
+    /* without --daemon, --idle-lock and --logind make csxlock resident too,
+     * locking only on inactivity or when logind asks */
+    Bool resident = opt_daemon || opt_idle_lock || opt_logind;
 
-    /* define cursor */
-    {
-        char curs[] = {0, 0, 0, 0, 0, 0, 0, 0};
-        Pixmap pmap = XCreateBitmapFromData(dpy, w, curs, 8, 8);
-        invisible = XCreatePixmapCursor(dpy, pmap, pmap, &background, &background, 0, 0);
-        XDefineCursor(dpy, w, invisible);
-        XFreePixmap(dpy, pmap);
-    }
+    /* a daemon waits for PAM right away, otherwise pam_start() overlaps the grab */
+    if (resident)
+        auth_ready();
 
-    /* create Graphics Context */
-    {
-        XGCValues values;
-        gc = XCreateGC(dpy, w, (unsigned long)0, &values);
-        XSetFont(dpy, gc, font->fid);
-        XSetForeground(dpy, gc, text_color.pixel);
-    }
+    do {
+        int client = -1;
+        uint64_t requested = 0;
 
-    /* grab pointer and keyboard */
-    int len = 1000;
-    while (len-- > 0) {
-        if (XGrabPointer(dpy, root, False, ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
-                    GrabModeAsync, GrabModeAsync, None, invisible, CurrentTime) == GrabSuccess)
-            break;
-        usleep(50);
-    }
-    while (len-- > 0) {
-        if (XGrabKeyboard(dpy, root, True, GrabModeAsync, GrabModeAsync, CurrentTime) == GrabSuccess)
-            break;
-        usleep(50);
-    }
-    if (len <= 0)
-        die("Cannot grab pointer/keyboard\n");
+        if (resident) {
+            client = daemon_wait();
+            if (exit_requested)
+                break;
+            if (stats_enabled)
+                requested = stats_now();
+        }
 
-    /* set up PAM */
-    {
-        int ret = pam_start("csxlock", username, &conv, &pam_handle);
-        if (ret != PAM_SUCCESS)
-            die("PAM: %s\n", pam_strerror(pam_handle, ret));
-    }
+        /* map the windows, grab pointer and keyboard of every display, keep
+         * them for the whole lock. Either all displays are locked or none. */
+        uint64_t trace = TRACE_START();
+        int locked = 0;
+        while (locked < ndisplays && lock_acquire(&displays[locked]))
+            locked++;
+        TRACE_SPAN("lock", trace, locked);
+        if (locked < ndisplays) {
+            while (locked > 0)
+                lock_release(&displays[--locked]);
+            if (!resident)
+                die("Cannot grab pointer/keyboard\n");
+            fprintf(stderr, "Warning: cannot grab pointer/keyboard, not locked.\n");
+            /* holding the suspend off would not help */
+            if (sleep_lock.pending) {
+                logind_release();
+                sleep_lock.pending = False;
+            }
+            control_reply(client, "error: cannot grab pointer/keyboard\n");
+            continue;
+        }
+        if (stats_enabled && resident)
+            stats_record(STATS_LOCK, stats_now() - requested);
+        control_reply(client, "locked\n");
+        logind_set_locked(True);
 
-    /* Lock the area where we store the password in memory, we don’t want it to
-     * be swapped to disk. Since Linux 2.6.9, this does not require any
-     * privileges, just enough bytes in the RLIMIT_MEMLOCK limit. */
-    if (mlock(password, sizeof(password)) != 0)
-        die("Could not lock page in memory, check RLIMIT_MEMLOCK\n");
+        if (!resident)
+            auth_ready();
 
-    /* handle dpms */
-    using_dpms = opt_usedpms && DPMSCapable(dpy);
-    if (using_dpms) {
-        /* save dpms timeouts to restore on exit */
-        DPMSGetTimeouts(dpy, &dpms_original.standby, &dpms_original.suspend, &dpms_original.off);
-        DPMSInfo(dpy, &dpms_original.level, &dpms_original.state);
+        /* handle dpms */
+        power_begin();
 
-        /* set program specific dpms timeouts */
-        DPMSSetTimeouts(dpy, dpms_timeout, dpms_timeout, dpms_timeout);
+        /* disable tty switching */
+        int term;
+        if ((term = open("/dev/console", O_RDWR)) == -1) {
+            fprintf(stderr, "error opening console\n");
+        }
+        int ioterm = ioctl(term, VT_LOCKSWITCH);
+        if (ioterm == -1) {
+            fprintf(stderr, "error locking console\n");
+        }
 
-        /* force dpms enabled until exit */
-        DPMSEnable(dpy);
-    }
 
-    /* disable tty switching */
-    int term;
-    if ((term = open("/dev/console", O_RDWR)) == -1) {
-        fprintf(stderr, "error opening console\n");
-    }
-    int ioterm = ioctl(term, VT_LOCKSWITCH);
-    if (ioterm == -1) {
-        fprintf(stderr, "error locking console\n");
-    }
+        /* run main loop */
+        main_loop(passdisp, opt_hidelength, username);
 
+        /* enable tty switching */
+        if (ioterm >= 0)
+            if ((ioctl(term, VT_UNLOCKSWITCH)) == -1) {
+                fprintf(stderr, "error unlocking console\n");
+            }
+        if(term >= 0)
+            close(term);
 
-    /* run main loop */
-    main_loop(w, gc, font, &info, passdisp, opt_username, background, text_color, errmsg_color, opt_hidelength, layoutGroups, tokenCount);
+        /* restore dpms settings */
+        power_end();
+        logind_set_locked(False);
 
-    /* enable tty switching */
-    if (ioterm >= 0)
-        if ((ioctl(term, VT_UNLOCKSWITCH)) == -1) {
-            fprintf(stderr, "error unlocking console\n");
-        }
-    if(term >= 0)
-        close(term);
+        for (int i = 0; i < ndisplays; i++)
+            lock_release(&displays[i]);
+    } while (resident && !exit_requested);
 
-    /* restore dpms settings */
-    if (using_dpms) {
-        DPMSSetTimeouts(dpy, dpms_original.standby, dpms_original.suspend, dpms_original.off);
-        if (!dpms_original.state)
-            DPMSDisable(dpy);
-    }
+    auth_close();
+    secure_release();
+    control_close();
 
-    XUngrabPointer(dpy, CurrentTime);
-    XFreeFont(dpy, font);
-    XFreeGC(dpy, gc);
-    XDestroyWindow(dpy, w);
-    XCloseDisplay(dpy);
+    for (int i = 0; i < ndisplays; i++)
+        display_close(&displays[i]);
+    if (wallpaper.opened)
+        image_close(&wallpaper.image);
+
+    stats_dump();
+    if (exit_requested)
+        die("Caught signal %d; dying\n", exit_requested);
     return 0;
 }
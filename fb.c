@@ -0,0 +1,150 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fb.h"
+
+int
+fb_init(Framebuffer *fb, int width, int height) {
+    memset(fb, 0, sizeof(*fb));
+    fb->width = width;
+    fb->height = height;
+    fb->back = calloc((size_t)width * height, sizeof(uint32_t));
+    fb->front = calloc((size_t)width * height, sizeof(uint32_t));
+    if (fb->back == NULL || fb->front == NULL) {
+        fb_free(fb);
+        return -1;
+    }
+    return 0;
+}
+
+void
+fb_free(Framebuffer *fb) {
+    free(fb->back);
+    free(fb->front);
+    fb->back = fb->front = NULL;
+}
+
+/*
+ * Fills a rectangle of the back buffer, clipped to the framebuffer.
+ *
+ */
+static void
+fb_fill(Framebuffer *fb, int x, int y, int width, int height, uint32_t color) {
+    int x1 = x < 0 ? 0 : x, y1 = y < 0 ? 0 : y;
+    int x2 = x + width > fb->width ? fb->width : x + width;
+    int y2 = y + height > fb->height ? fb->height : y + height;
+
+    for (int row = y1; row < y2; row++) {
+        uint32_t *p = fb->back + (size_t)row * fb->width;
+        for (int col = x1; col < x2; col++)
+            p[col] = color;
+    }
+    if (x2 > x1 && y2 > y1)
+        fb->pixels += (unsigned long)(x2 - x1) * (y2 - y1);
+}
+
+static int
+fb_text_width(Canvas *canvas, const char *text, int len) {
+    (void)canvas;
+    (void)text;
+    return len * FB_GLYPH_WIDTH;
+}
+
+/* the framebuffer is the whole window, there is no back buffer to resize */
+static void
+fb_place(Canvas *canvas, const RenderRect *area) {
+    (void)canvas;
+    (void)area;
+}
+
+static void
+fb_clear(Canvas *canvas, int x, int y, int width, int height) {
+    FbCanvas *c = (FbCanvas *)canvas;
+    c->fb->ops++;
+    fb_fill(c->fb, x, y, width, height, c->background);
+}
+
+/*
+ * Draws every visible character as a box filling most of its cell, enough
+ * to touch the pixels real glyphs would.
+ *
+ */
+static void
+fb_text(Canvas *canvas, int x, int y, unsigned long color, const char *text, int len) {
+    FbCanvas *c = (FbCanvas *)canvas;
+    c->fb->ops++;
+    for (int i = 0; i < len; i++)
+        if (text[i] != ' ')
+            fb_fill(c->fb, x + i * FB_GLYPH_WIDTH + 1, y - FB_ASCENT + 2,
+                    FB_GLYPH_WIDTH - 2, FB_ASCENT - 2, (uint32_t)color);
+}
+
+static void
+fb_line(Canvas *canvas, int x1, int y1, int x2, int y2, unsigned long color) {
+    FbCanvas *c = (FbCanvas *)canvas;
+    int dx = abs(x2 - x1), dy = -abs(y2 - y1);
+    int sx = x1 < x2 ? 1 : -1, sy = y1 < y2 ? 1 : -1;
+    int err = dx + dy;
+
+    c->fb->ops++;
+    /* Bresenham, both end points included like XDrawLine */
+    for (;;) {
+        fb_fill(c->fb, x1, y1, 1, 1, (uint32_t)color);
+        if (x1 == x2 && y1 == y2)
+            break;
+        int e2 = 2 * err;
+        if (e2 >= dy) {
+            err += dy;
+            x1 += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            y1 += sy;
+        }
+    }
+}
+
+static void
+fb_flush(Canvas *canvas, const RenderRect *damage, int ndamage) {
+    Framebuffer *fb = ((FbCanvas *)canvas)->fb;
+
+    fb->ops++;
+    for (int i = 0; i < ndamage; i++) {
+        const RenderRect *r = &damage[i];
+        for (int row = r->y; row < r->y + r->height; row++) {
+            size_t offset = (size_t)row * fb->width + r->x;
+            memcpy(fb->front + offset, fb->back + offset, r->width * sizeof(uint32_t));
+        }
+        fb->pixels += (unsigned long)r->width * r->height;
+    }
+}
+
+static const RenderBackend fb_backend = {
+    .text_width = fb_text_width,
+    .place = fb_place,
+    .clear = fb_clear,
+    .text = fb_text,
+    .line = fb_line,
+    .flush = fb_flush,
+};
+
+void
+fb_canvas_init(FbCanvas *canvas, Framebuffer *fb, uint32_t background, uint32_t text_color) {
+    memset(canvas, 0, sizeof(*canvas));
+    canvas->canvas.backend = &fb_backend;
+    canvas->canvas.buffered = 1;
+    canvas->canvas.ascent = FB_ASCENT;
+    canvas->canvas.descent = FB_DESCENT;
+    canvas->canvas.text_color = text_color;
+    canvas->fb = fb;
+    canvas->background = background;
+}
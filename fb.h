@@ -0,0 +1,48 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#ifndef CSXLOCK_FB_H
+#define CSXLOCK_FB_H
+
+#include <stdint.h>
+
+#include "render.h"
+
+/* cell of the built-in font, every character is a box */
+#define FB_GLYPH_WIDTH  8
+#define FB_ASCENT       12
+#define FB_DESCENT      4
+
+/*
+ * A lock window in memory, 0xAARRGGBB pixels. Canvases draw into back,
+ * flushes copy the damaged areas to front, like a back buffer pixmap and
+ * the window.
+ */
+typedef struct Framebuffer {
+    int width, height;
+    uint32_t *back;
+    uint32_t *front;
+    unsigned long ops;      /* backend calls, for benchmarks */
+    unsigned long pixels;   /* pixels written */
+} Framebuffer;
+
+/* a canvas drawing into a framebuffer, its output must lie within it */
+typedef struct FbCanvas {
+    Canvas canvas;
+    Framebuffer *fb;
+    uint32_t background;
+} FbCanvas;
+
+/* returns -1 when out of memory */
+int fb_init(Framebuffer *fb, int width, int height);
+void fb_free(Framebuffer *fb);
+
+void fb_canvas_init(FbCanvas *canvas, Framebuffer *fb, uint32_t background, uint32_t text_color);
+
+#endif /* CSXLOCK_FB_H */
@@ -0,0 +1,363 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>     // PATH_MAX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>   // mmap()
+#include <sys/stat.h>
+#ifdef USE_PNG
+#include <png.h>
+#endif
+
+#include "cache.h"
+#include "image.h"
+
+/* larger images are refused, before anything is decoded */
+#define MAX_SIDE (1 << 16)
+
+/* header of a cached image, followed by width * height 0x00RRGGBB pixels */
+typedef struct CacheHeader {
+    char magic[8];
+    uint32_t width, height;
+} CacheHeader;
+
+static const char cache_magic[8] = "csxlock1";
+
+static uint32_t
+read_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/*
+ * Reads an unsigned number of a PPM header, skipping whitespace and comments
+ * in front of it. Returns -1 when there is none.
+ *
+ */
+static long
+ppm_number(const unsigned char **p, const unsigned char *end) {
+    long value = -1;
+
+    while (*p < end) {
+        if (**p == '#') {
+            while (*p < end && **p != '\n')
+                (*p)++;
+        } else if (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r') {
+            (*p)++;
+        } else {
+            break;
+        }
+    }
+    while (*p < end && **p >= '0' && **p <= '9' && value < 1L << 24)
+        value = (value < 0 ? 0 : value * 10) + *(*p)++ - '0';
+    return value;
+}
+
+static const char *
+parse_farbfeld(Image *image) {
+    const unsigned char *map = image->map;
+
+    if (image->map_size < 16)
+        return "truncated farbfeld header";
+    image->width = read_be32(map + 8);
+    image->height = read_be32(map + 12);
+    image->format = IMAGE_FARBFELD;
+    image->depth = 2;
+    image->channels = 4;
+    image->data = map + 16;
+    return NULL;
+}
+
+static const char *
+parse_ppm(Image *image) {
+    const unsigned char *p = (const unsigned char *)image->map + 2;
+    const unsigned char *end = (const unsigned char *)image->map + image->map_size;
+    long width = ppm_number(&p, end);
+    long height = ppm_number(&p, end);
+    long maxval = ppm_number(&p, end);
+
+    /* exactly one whitespace character ends the header */
+    if (width <= 0 || height <= 0 || maxval <= 0 || maxval > 65535 || p == end)
+        return "invalid PPM header";
+    image->width = width;
+    image->height = height;
+    image->format = IMAGE_PPM;
+    image->depth = maxval > 255 ? 2 : 1;
+    image->channels = 3;
+    image->maxval = maxval;
+    image->data = p + 1;
+    return NULL;
+}
+
+#ifdef USE_PNG
+static const char *
+parse_png(Image *image) {
+    static char message[sizeof(((png_image *)NULL)->message)];
+    png_image png;
+
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    if (png_image_begin_read_from_memory(&png, image->map, image->map_size)) {
+        if (png.width > MAX_SIDE || png.height > MAX_SIDE) {
+            png_image_free(&png);
+            return "image too large";
+        }
+        png.format = PNG_FORMAT_RGBA;
+        if ((image->decoded = malloc(PNG_IMAGE_SIZE(png))) == NULL) {
+            png_image_free(&png);
+            return "out of memory";
+        }
+        if (png_image_finish_read(&png, NULL, image->decoded, 0, NULL)) {
+            image->width = png.width;
+            image->height = png.height;
+            image->format = IMAGE_RGBA;
+            image->depth = 1;
+            image->channels = 4;
+            image->data = image->decoded;
+            return NULL;
+        }
+    }
+    snprintf(message, sizeof(message), "%s", png.message);
+    return message;
+}
+#endif
+
+/*
+ * Maps an image file. Returns NULL on success, otherwise a description of
+ * the problem.
+ *
+ */
+const char *
+image_open(Image *image, const char *path) {
+    struct stat st;
+    const char *error;
+    int fd;
+
+    memset(image, 0, sizeof(*image));
+    image->map = MAP_FAILED;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1)
+            close(fd);
+        return "can not open file";
+    }
+    image->map_size = st.st_size;
+    if (image->map_size > 0)
+        image->map = mmap(NULL, image->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image->map == MAP_FAILED)
+        return "can not map file";
+
+    if (image->map_size >= 8 && memcmp(image->map, "farbfeld", 8) == 0)
+        error = parse_farbfeld(image);
+    else if (image->map_size >= 2 && memcmp(image->map, "P6", 2) == 0)
+        error = parse_ppm(image);
+#ifdef USE_PNG
+    else if (image->map_size >= 8 && memcmp(image->map, "\x89PNG\r\n\x1a\n", 8) == 0)
+        error = parse_png(image);
+#endif
+    else
+        error = "unknown format, farbfeld, PPM (P6) or PNG expected";
+
+    if (error == NULL) {
+        image->stride = (size_t)image->width * image->channels * image->depth;
+        if (image->width <= 0 || image->height <= 0)
+            error = "empty image";
+        else if (image->width > MAX_SIDE || image->height > MAX_SIDE)
+            error = "image too large";
+        else if (image->format != IMAGE_RGBA &&
+                (size_t)(image->data - (const unsigned char *)image->map) +
+                image->stride * image->height > image->map_size)
+            error = "truncated image";
+    }
+
+    if (error)
+        image_close(image);
+    return error;
+}
+
+void
+image_close(Image *image) {
+    if (image->map != MAP_FAILED && image->map != NULL)
+        munmap(image->map, image->map_size);
+    free(image->decoded);
+    memset(image, 0, sizeof(*image));
+    image->map = MAP_FAILED;
+}
+
+/*
+ * Returns one channel of a pixel as 8 bits. 16 bit channels are big endian,
+ * PPM values are relative to the header's maximum.
+ *
+ */
+static unsigned int
+image_channel(const Image *image, const unsigned char *row, int x, int c) {
+    const unsigned char *p = row + ((size_t)x * image->channels + c) * image->depth;
+
+    if (image->format == IMAGE_PPM) {
+        unsigned int value = image->depth == 2 ? (unsigned int)p[0] << 8 | p[1] : p[0];
+        return image->maxval == 255 ? value : value * 255 / image->maxval;
+    }
+    return p[0];
+}
+
+/*
+ * Bilinear scaling, the source is read in place. The scale factor is chosen
+ * so the image covers the whole area, the centered part which fits is used.
+ *
+ */
+void
+image_scale(const Image *image, int width, int height, uint32_t *out, size_t stride) {
+    /* 16.16 fixed point source position of the first pixel and the step */
+    double scale = (double)image->width / width;
+    if ((double)image->height / height < scale)
+        scale = (double)image->height / height;
+    int64_t step = scale * 65536;
+    int64_t x0 = ((image->width - width * scale) / 2 + scale / 2 - 0.5) * 65536;
+    int64_t y0 = ((image->height - height * scale) / 2 + scale / 2 - 0.5) * 65536;
+
+    int *columns = malloc(sizeof(int) * 2 * width);
+    if (columns == NULL)
+        return;
+    for (int x = 0; x < width; x++) {
+        int64_t sx = x0 + x * step;
+        if (sx < 0)
+            sx = 0;
+        if (sx > (int64_t)(image->width - 1) << 16)
+            sx = (int64_t)(image->width - 1) << 16;
+        columns[2 * x] = sx >> 16;
+        columns[2 * x + 1] = (sx >> 8) & 0xff;
+    }
+
+    for (int y = 0; y < height; y++) {
+        int64_t sy = y0 + y * step;
+        if (sy < 0)
+            sy = 0;
+        if (sy > (int64_t)(image->height - 1) << 16)
+            sy = (int64_t)(image->height - 1) << 16;
+        int iy = sy >> 16, fy = (sy >> 8) & 0xff;
+        const unsigned char *row0 = image->data + iy * image->stride;
+        const unsigned char *row1 = iy + 1 < image->height ? row0 + image->stride : row0;
+
+        for (int x = 0; x < width; x++) {
+            int ix = columns[2 * x], fx = columns[2 * x + 1];
+            int ix1 = ix + 1 < image->width ? ix + 1 : ix;
+            uint32_t pixel = 0;
+
+            for (int c = 0; c < 3; c++) {
+                unsigned int top = image_channel(image, row0, ix, c) * (256 - fx) +
+                    image_channel(image, row0, ix1, c) * fx;
+                unsigned int bottom = image_channel(image, row1, ix, c) * (256 - fx) +
+                    image_channel(image, row1, ix1, c) * fx;
+                pixel = pixel << 8 | (top * (256 - fy) + bottom * fy) >> 16;
+            }
+            out[y * stride + x] = pixel;
+        }
+    }
+
+    free(columns);
+}
+
+/*
+ * Builds the name of the cache file of an image scaled to width x height,
+ * in $XDG_CACHE_HOME/csxlock or ~/.cache/csxlock, creating the directory.
+ * The key changes with the file's identity, size and modification time, so
+ * stale entries are never used. Returns -1 when there is no usable cache.
+ *
+ */
+int
+image_cache_path(char *buf, size_t size, const char *path, int width, int height) {
+    char dir[PATH_MAX], real[PATH_MAX];
+    struct stat st;
+    uint64_t key = CACHE_HASH_INIT;
+
+    if (realpath(path, real) == NULL || stat(real, &st) == -1)
+        return -1;
+    key = cache_hash(key, real, strlen(real));
+    key = cache_hash(key, &st.st_dev, sizeof(st.st_dev));
+    key = cache_hash(key, &st.st_ino, sizeof(st.st_ino));
+    key = cache_hash(key, &st.st_size, sizeof(st.st_size));
+    key = cache_hash(key, &st.st_mtime, sizeof(st.st_mtime));
+
+    if (cache_dir(dir, sizeof(dir)) == -1)
+        return -1;
+
+    if ((size_t)snprintf(buf, size, "%s/%016llx-%dx%d", dir, (unsigned long long)key,
+                width, height) >= size)
+        return -1;
+    return 0;
+}
+
+/*
+ * Maps a cached image, the pixels are used from the mapping without copying.
+ * Returns NULL when there is no valid entry.
+ *
+ */
+const uint32_t *
+image_cache_map(const char *cache, int width, int height, size_t *map_size) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(cache, O_RDONLY)) == -1)
+        return NULL;
+    *map_size = sizeof(CacheHeader) + (size_t)width * height * sizeof(uint32_t);
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size != *map_size) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, *map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const CacheHeader *header = map;
+    if (memcmp(header->magic, cache_magic, sizeof(cache_magic)) != 0 ||
+            header->width != (uint32_t)width || header->height != (uint32_t)height) {
+        munmap(map, *map_size);
+        return NULL;
+    }
+    return (const uint32_t *)(header + 1);
+}
+
+void
+image_cache_unmap(const uint32_t *pixels, size_t map_size) {
+    munmap((void *)((const CacheHeader *)pixels - 1), map_size);
+}
+
+/*
+ * Stores a scaled image. Written to a temporary file first, so a concurrent
+ * reader never maps half an entry.
+ *
+ */
+void
+image_cache_store(const char *cache, int width, int height, const uint32_t *pixels, size_t stride) {
+    char tmp[PATH_MAX];
+    CacheHeader header;
+    FILE *f;
+    int ok;
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d", cache, (int)getpid()) >= sizeof(tmp))
+        return;
+    if ((f = fopen(tmp, "wb")) == NULL)
+        return;
+
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.width = width;
+    header.height = height;
+    ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (int y = 0; ok && y < height; y++)
+        ok = fwrite(pixels + y * stride, sizeof(uint32_t), width, f) == (size_t)width;
+
+    if (fclose(f) != 0 || !ok || rename(tmp, cache) == -1)
+        unlink(tmp);
+}
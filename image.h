@@ -0,0 +1,52 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#ifndef CSXLOCK_IMAGE_H
+#define CSXLOCK_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum ImageFormat {
+    IMAGE_FARBFELD,     /* 16 bit big endian RGBA */
+    IMAGE_PPM,          /* binary (P6), 8 or 16 bit RGB */
+    IMAGE_RGBA,         /* 8 bit RGBA, decoded from PNG */
+} ImageFormat;
+
+/* a source image, farbfeld and PPM pixels are read straight from the mapping */
+typedef struct Image {
+    int width, height;
+    ImageFormat format;
+    int depth;                  /* bytes per channel */
+    int channels;
+    int maxval;                 /* of a PPM */
+    size_t stride;              /* bytes per row */
+    const unsigned char *data;  /* first pixel */
+    void *map;                  /* the mapped file */
+    size_t map_size;
+    unsigned char *decoded;     /* pixels of a decoded PNG */
+} Image;
+
+/* returns NULL on success, otherwise what is wrong with the file */
+const char *image_open(Image *image, const char *path);
+void image_close(Image *image);
+
+/*
+ * Scales the image to cover width x height, cropping what does not fit, into
+ * 0x00RRGGBB pixels with the given number of pixels per row.
+ */
+void image_scale(const Image *image, int width, int height, uint32_t *out, size_t stride);
+
+/* pre-scaled images, keyed by source file and resolution */
+int image_cache_path(char *buf, size_t size, const char *path, int width, int height);
+const uint32_t *image_cache_map(const char *cache, int width, int height, size_t *map_size);
+void image_cache_unmap(const uint32_t *pixels, size_t map_size);
+void image_cache_store(const char *cache, int width, int height, const uint32_t *pixels, size_t stride);
+
+#endif /* CSXLOCK_IMAGE_H */
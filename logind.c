@@ -0,0 +1,258 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "logind.h"
+
+#ifdef USE_LOGIND
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <systemd/sd-bus.h>
+
+#define LOGIND_NAME     "org.freedesktop.login1"
+#define MANAGER_PATH    "/org/freedesktop/login1"
+#define MANAGER_IFACE   "org.freedesktop.login1.Manager"
+#define SESSION_IFACE   "org.freedesktop.login1.Session"
+
+static sd_bus *bus;
+static char *session;       /* object path, NULL when not in a session */
+static int inhibitor = -1;  /* delay lock, suspend waits while it is open */
+static uint64_t budget;     /* InhibitDelayMaxUSec */
+static int events;          /* collected by the signal handlers */
+
+static int
+on_prepare_for_sleep(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+    int start;
+
+    (void)userdata;
+    (void)error;
+    if (sd_bus_message_read(m, "b", &start) >= 0)
+        events |= start ? LOGIND_SLEEP : LOGIND_RESUME;
+    return 0;
+}
+
+static int
+on_lock(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+    (void)m;
+    (void)userdata;
+    (void)error;
+    events |= LOGIND_LOCK;
+    return 0;
+}
+
+static int
+on_unlock(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+    (void)m;
+    (void)userdata;
+    (void)error;
+    events |= LOGIND_UNLOCK;
+    return 0;
+}
+
+/*
+ * Takes a delay inhibitor for sleep. The descriptor belongs to the reply,
+ * a copy is kept, closed on exec and closed by forked children.
+ *
+ */
+static void
+inhibit(void) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    int fd;
+
+    if (inhibitor != -1)
+        return;
+    if (sd_bus_call_method(bus, LOGIND_NAME, MANAGER_PATH, MANAGER_IFACE, "Inhibit", &error, &reply,
+                "ssss", "sleep", "csxlock", "Locking the screen before suspend", "delay") < 0 ||
+            sd_bus_message_read(reply, "h", &fd) < 0 || (inhibitor = dup(fd)) == -1) {
+        fprintf(stderr, "Warning: no logind inhibitor, suspend may come before the lock: %s\n",
+                error.message ? error.message : strerror(errno));
+    } else {
+        fcntl(inhibitor, F_SETFD, FD_CLOEXEC);
+    }
+    sd_bus_message_unref(reply);
+    sd_bus_error_free(&error);
+}
+
+/*
+ * The session csxlock runs in, from $XDG_SESSION_ID or else from the pid.
+ * A lock started outside of any session only follows suspends.
+ *
+ */
+static void
+find_session(void) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    const char *id = getenv("XDG_SESSION_ID");
+    const char *path;
+    int r;
+
+    if (id)
+        r = sd_bus_call_method(bus, LOGIND_NAME, MANAGER_PATH, MANAGER_IFACE, "GetSession",
+                &error, &reply, "s", id);
+    else
+        r = sd_bus_call_method(bus, LOGIND_NAME, MANAGER_PATH, MANAGER_IFACE, "GetSessionByPID",
+                &error, &reply, "u", (uint32_t)getpid());
+    if (r >= 0 && sd_bus_message_read(reply, "o", &path) >= 0)
+        session = strdup(path);
+    else
+        fprintf(stderr, "Warning: not in a logind session, lock-session and unlock-session are ignored.\n");
+    sd_bus_message_unref(reply);
+    sd_bus_error_free(&error);
+}
+
+int
+logind_open(void) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    int r;
+
+    if ((r = sd_bus_open_system(&bus)) < 0 ||
+            (r = sd_bus_match_signal(bus, NULL, LOGIND_NAME, MANAGER_PATH, MANAGER_IFACE,
+                "PrepareForSleep", on_prepare_for_sleep, NULL)) < 0) {
+        bus = sd_bus_close_unref(bus);
+        errno = -r;
+        return -1;
+    }
+
+    find_session();
+    if (session) {
+        sd_bus_match_signal(bus, NULL, LOGIND_NAME, session, SESSION_IFACE, "Lock", on_lock, NULL);
+        sd_bus_match_signal(bus, NULL, LOGIND_NAME, session, SESSION_IFACE, "Unlock", on_unlock, NULL);
+    }
+    if (sd_bus_get_property_trivial(bus, LOGIND_NAME, MANAGER_PATH, MANAGER_IFACE,
+                "InhibitDelayMaxUSec", &error, 't', &budget) < 0)
+        budget = 0;
+    sd_bus_error_free(&error);
+
+    inhibit();
+    return 0;
+}
+
+void
+logind_pollfd(struct pollfd *pfd) {
+    pfd->fd = bus ? sd_bus_get_fd(bus) : -1;
+    pfd->events = bus ? sd_bus_get_events(bus) : 0;
+    pfd->revents = 0;
+}
+
+int
+logind_timeout(void) {
+    struct timespec ts;
+    uint64_t at, now;
+
+    if (!bus || sd_bus_get_timeout(bus, &at) < 0 || at == UINT64_MAX)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    return at > now ? (int)((at - now + 999) / 1000) : 0;
+}
+
+/*
+ * A broken connection is given up, locking goes on without logind.
+ *
+ */
+int
+logind_dispatch(void) {
+    int r;
+
+    if (!bus)
+        return 0;
+    events = 0;
+    while ((r = sd_bus_process(bus, NULL)) > 0)
+        ;
+    if (r < 0) {
+        fprintf(stderr, "Warning: lost the connection to logind: %s\n", strerror(-r));
+        bus = sd_bus_close_unref(bus);
+        logind_release();
+    }
+
+    /* ready for the next suspend */
+    if (events & LOGIND_RESUME)
+        inhibit();
+    return events;
+}
+
+void
+logind_release(void) {
+    if (inhibitor != -1)
+        close(inhibitor);
+    inhibitor = -1;
+}
+
+uint64_t
+logind_budget(void) {
+    return budget;
+}
+
+void
+logind_set_locked(int locked) {
+    if (!bus || !session)
+        return;
+    sd_bus_call_method_async(bus, NULL, LOGIND_NAME, session, SESSION_IFACE, "SetLockedHint",
+            NULL, NULL, "b", locked);
+}
+
+void
+logind_forked(void) {
+    if (inhibitor != -1)
+        close(inhibitor);
+    if (bus)
+        close(sd_bus_get_fd(bus));
+}
+
+#else
+
+int
+logind_open(void) {
+    errno = ENOSYS;
+    return -1;
+}
+
+void
+logind_pollfd(struct pollfd *pfd) {
+    pfd->fd = -1;
+    pfd->events = 0;
+    pfd->revents = 0;
+}
+
+int
+logind_timeout(void) {
+    return -1;
+}
+
+int
+logind_dispatch(void) {
+    return 0;
+}
+
+void
+logind_release(void) {
+}
+
+uint64_t
+logind_budget(void) {
+    return 0;
+}
+
+void
+logind_set_locked(int locked) {
+    (void)locked;
+}
+
+void
+logind_forked(void) {
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#ifndef CSXLOCK_LOGIND_H
+#define CSXLOCK_LOGIND_H
+
+#include <stdint.h>
+#include <poll.h>
+
+/*
+ * systemd-logind integration, built with USE_LOGIND. A delay inhibitor
+ * holds off suspend until the lock is painted, PrepareForSleep and the
+ * Lock and Unlock signals of the session are reported to the event loop.
+ */
+
+/* what logind_dispatch() saw */
+enum {
+    LOGIND_SLEEP    = 1 << 0,   /* about to suspend, lock and logind_release() */
+    LOGIND_RESUME   = 1 << 1,   /* back from suspend, the inhibitor is taken again */
+    LOGIND_LOCK     = 1 << 2,   /* loginctl lock-session */
+    LOGIND_UNLOCK   = 1 << 3,   /* loginctl unlock-session */
+};
+
+/*
+ * Connects to the system bus ($DBUS_SYSTEM_BUS_ADDRESS is honored) and
+ * takes the inhibitor. Returns -1 with errno set on failure, ENOSYS when
+ * built without logind support.
+ */
+int logind_open(void);
+
+/* the bus connection to poll, fd -1 when not open */
+void logind_pollfd(struct pollfd *pfd);
+
+/* the poll() timeout sd-bus needs, -1 for none */
+int logind_timeout(void);
+
+/* handles everything received, returns LOGIND_* flags */
+int logind_dispatch(void);
+
+/* the lock is on screen: lets a suspend go on */
+void logind_release(void);
+
+/* how long logind waits for the inhibitor at most, us, 0 when unknown */
+uint64_t logind_budget(void);
+
+/* tells logind whether the session is locked */
+void logind_set_locked(int locked);
+
+/* in a forked child: drops the inherited descriptors, the parent keeps
+ * the inhibitor and the connection */
+void logind_forked(void);
+
+#endif /* CSXLOCK_LOGIND_H */
@@ -0,0 +1,140 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#include <ctype.h>      // isprint()
+#include <stdio.h>
+
+#include "prompt.h"
+#include "secure.h"
+
+const char prompt_authenticating[] = "authenticating...";
+const char prompt_failed[] = "authentication failed";
+const char prompt_caps[] = "Caps lock is on";
+
+void
+prompt_init(Prompt *prompt, char *password, unsigned int size) {
+    prompt->password = password;
+    prompt->size = size;
+    prompt->len = 0;
+    prompt->failed = 0;
+    prompt->queued = 0;
+}
+
+void
+prompt_input(Prompt *prompt) {
+    prompt->failed = 0;
+}
+
+/*
+ * Edits the password. While a verdict is pending, the input typed so far is
+ * submitted as soon as the verdict fails.
+ *
+ */
+PromptAction
+prompt_key(Prompt *prompt, PromptKey key, char c, int pending) {
+    prompt_input(prompt);
+
+    switch (key) {
+        case PROMPT_KEY_SUBMIT:
+            if (pending) {
+                prompt->queued = 1;
+                return PROMPT_NONE;
+            }
+            prompt->password[prompt->len] = 0;
+            return PROMPT_SUBMIT;
+        case PROMPT_KEY_CANCEL:
+            prompt->len = 0;
+            prompt->queued = 0;
+            return PROMPT_CANCEL;
+        case PROMPT_KEY_ERASE:
+            if (prompt->len)
+                --prompt->len;
+            return PROMPT_NONE;
+        case PROMPT_KEY_TEXT:
+            if (isprint((unsigned char)c) && prompt->len + 1 < prompt->size)
+                prompt->password[prompt->len++] = c;
+            return PROMPT_NONE;
+    }
+    return PROMPT_NONE;
+}
+
+void
+prompt_submitted(Prompt *prompt, int sent) {
+    prompt->failed = !sent;
+    secure_clear(prompt->password, prompt->size);
+    prompt->len = 0;
+}
+
+PromptAction
+prompt_verdict(Prompt *prompt, int success) {
+    if (success) {
+        secure_clear(prompt->password, prompt->size);
+        prompt->len = 0;
+        prompt->queued = 0;
+        return PROMPT_UNLOCK;
+    }
+
+    prompt->failed = 1;
+    /* input typed meanwhile is the next attempt */
+    if (!prompt->queued)
+        return PROMPT_NONE;
+    prompt->queued = 0;
+    prompt->password[prompt->len] = 0;
+    return PROMPT_SUBMIT;
+}
+
+int
+prompt_text(const Prompt *prompt, int pending, const char *mask, int scramble,
+        const char **text, int *len) {
+    if (pending) {
+        *text = prompt_authenticating;
+        *len = sizeof(prompt_authenticating) - 1;
+        return 0;
+    }
+    if (prompt->failed) {
+        *text = prompt_failed;
+        *len = sizeof(prompt_failed) - 1;
+        return 1;
+    }
+
+    int lendisp = prompt->len;
+    if (scramble && prompt->len > 0)
+        lendisp += (mask[prompt->len] * prompt->len) % 5;
+    *text = mask;
+    *len = lendisp % 256;
+    return 0;
+}
+
+int
+prompt_info(char *buf, size_t size, const char *datetime, const char *layout, const char *status) {
+    int len = snprintf(buf, size, "%s%s%s%s%s", datetime,
+            layout ? " | " : "", layout ? layout : "", status[0] ? " | " : "", status);
+    if (len < 0) {
+        buf[0] = '\0';
+        return 0;
+    }
+    return len < (int)size ? len : (int)size - 1;
+}
+
+/*
+ * Only the widgets whose text or color changed are repainted, a frame which
+ * shows the same as the previous one draws nothing.
+ *
+ */
+void
+prompt_frame(Canvas *canvas, const PromptFrame *frame, unsigned long text_color,
+        unsigned long error_color) {
+    widget_set(canvas, WIDGET_PASSWORD, frame->pass, frame->pass_len,
+            frame->pass_error ? error_color : text_color);
+    widget_set(canvas, WIDGET_INFO, frame->info, frame->info_len, text_color);
+    if (frame->caps)
+        widget_set(canvas, WIDGET_CAPS, prompt_caps, sizeof(prompt_caps) - 1, error_color);
+    else
+        widget_set(canvas, WIDGET_CAPS, "", 0, error_color);
+}
@@ -0,0 +1,91 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#ifndef CSXLOCK_PROMPT_H
+#define CSXLOCK_PROMPT_H
+
+#include <stddef.h>
+
+#include "render.h"
+
+/* messages shown in the password line, compared by address when measured */
+extern const char prompt_authenticating[];
+extern const char prompt_failed[];
+
+/* shown below the password line while caps lock is on */
+extern const char prompt_caps[];
+
+/* keys the prompt reacts to */
+typedef enum PromptKey {
+    PROMPT_KEY_TEXT,        /* a character, ignored unless printable */
+    PROMPT_KEY_SUBMIT,      /* Return */
+    PROMPT_KEY_CANCEL,      /* Escape */
+    PROMPT_KEY_ERASE,       /* BackSpace */
+} PromptKey;
+
+/* what the caller has to do next */
+typedef enum PromptAction {
+    PROMPT_NONE,
+    PROMPT_SUBMIT,          /* authenticate the NUL terminated password */
+    PROMPT_CANCEL,          /* the input was dropped, power the display down */
+    PROMPT_UNLOCK,          /* authenticated */
+} PromptAction;
+
+/* the password being typed and the state of the last attempt */
+typedef struct Prompt {
+    char *password;
+    unsigned int size;
+    unsigned int len;
+    int failed;             /* the last attempt failed, shown until input */
+    int queued;             /* submitted again while a verdict was pending */
+} Prompt;
+
+void prompt_init(Prompt *prompt, char *password, unsigned int size);
+
+/* any input, hides a failure */
+void prompt_input(Prompt *prompt);
+
+/* a key was pressed, pending while a verdict is awaited */
+PromptAction prompt_key(Prompt *prompt, PromptKey key, char c, int pending);
+
+/* the password was handed on, sent is 0 when that failed */
+void prompt_submitted(Prompt *prompt, int sent);
+
+/* the verdict arrived, a queued attempt is submitted right away */
+PromptAction prompt_verdict(Prompt *prompt, int success);
+
+/*
+ * The password line: mask prefixes (with scramble, the length is deranged),
+ * or a message. Returns non-zero when it is an error.
+ */
+int prompt_text(const Prompt *prompt, int pending, const char *mask, int scramble,
+        const char **text, int *len);
+
+/*
+ * The info line: date and time, then the keyboard layout (NULL when unknown)
+ * and the text of the status providers when there is any. Returns the
+ * length, cut to fit size.
+ */
+int prompt_info(char *buf, size_t size, const char *datetime, const char *layout, const char *status);
+
+/* what a frame shows, the same on every canvas of a display */
+typedef struct PromptFrame {
+    const char *pass;       /* from prompt_text() */
+    int pass_len;
+    int pass_error;
+    const char *info;       /* from prompt_info() */
+    int info_len;
+    int caps;               /* caps lock is on */
+} PromptFrame;
+
+/* sets the widgets of a canvas for the frame, canvas_render() draws them */
+void prompt_frame(Canvas *canvas, const PromptFrame *frame, unsigned long text_color,
+        unsigned long error_color);
+
+#endif /* CSXLOCK_PROMPT_H */
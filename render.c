@@ -0,0 +1,190 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#include <string.h>
+
+#include "render.h"
+
+#ifndef MIN
+    #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+    #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+void
+widget_set(Canvas *canvas, int id, const char *text, int len, unsigned long color) {
+    Widget *widget = &canvas->widgets[id];
+
+    if (len >= (int)sizeof(widget->text))
+        len = sizeof(widget->text) - 1;
+
+    if (widget->len == len && widget->color == color && memcmp(widget->text, text, len) == 0)
+        return;
+
+    memcpy(widget->text, text, len);
+    widget->text[len] = '\0';
+    widget->len = len;
+    widget->color = color;
+    widget->width = len ? canvas->backend->text_width(canvas, text, len) : 0;
+    widget->dirty = 1;
+}
+
+/*
+ * Remembers a window area which has to be flushed on the next frame. Falls
+ * back to the whole canvas when out of slots.
+ *
+ */
+static void
+canvas_add_damage(Canvas *canvas, int x, int y, int width, int height) {
+    /* clip to the canvas */
+    const RenderRect *area = &canvas->area;
+    int x1 = MAX(x, area->x), y1 = MAX(y, area->y);
+    int x2 = MIN(x + width, area->x + area->width);
+    int y2 = MIN(y + height, area->y + area->height);
+
+    if (!canvas->buffered || x2 <= x1 || y2 <= y1)
+        return;
+
+    if (canvas->ndamage == sizeof(canvas->damage) / sizeof(canvas->damage[0])) {
+        x1 = area->x, y1 = area->y;
+        x2 = x1 + area->width, y2 = y1 + area->height;
+        canvas->ndamage = 0;
+    }
+
+    RenderRect *r = &canvas->damage[canvas->ndamage++];
+    r->x = x1;
+    r->y = y1;
+    r->width = x2 - x1;
+    r->height = y2 - y1;
+}
+
+static void
+canvas_clear(Canvas *canvas, int x, int y, int width, int height) {
+    canvas->backend->clear(canvas, x, y, width, height);
+    canvas_add_damage(canvas, x, y, width, height);
+}
+
+/*
+ * Paints a dirty widget centered on the canvas: one clear covering both the
+ * old and the new bounding box, followed by the text.
+ *
+ */
+static void
+widget_draw(Canvas *canvas, Widget *widget) {
+    RenderRect box;
+    int height = canvas->ascent + canvas->descent;
+
+    box.x = canvas->center_x - widget->width / 2;
+    box.y = widget->baseline - canvas->ascent;
+    box.width = widget->width;
+    box.height = height;
+
+    /* clear whatever the previous frame left there */
+    if (widget->box.width > 0) {
+        int x1 = MIN(box.x, widget->box.x);
+        int x2 = MAX(box.x + box.width, widget->box.x + widget->box.width);
+        if (box.width == 0)
+            x1 = widget->box.x, x2 = widget->box.x + widget->box.width;
+        canvas_clear(canvas, x1, box.y, x2 - x1, height);
+    } else {
+        canvas_add_damage(canvas, box.x, box.y, box.width, height);
+    }
+
+    if (widget->len > 0)
+        canvas->backend->text(canvas, box.x, widget->baseline, widget->color, widget->text, widget->len);
+
+    widget->box = box;
+    widget->dirty = 0;
+}
+
+/*
+ * Marks everything for repainting, used for the first frame and, unbuffered,
+ * after an Expose. The server already cleared the exposed area, and a back
+ * buffer is cleared here, so no clearing is needed.
+ *
+ */
+void
+canvas_damage_all(Canvas *canvas) {
+    for (int i = 0; i < WIDGET_COUNT; i++) {
+        canvas->widgets[i].box.width = 0;
+        canvas->widgets[i].dirty = 1;
+    }
+    canvas->line_dirty = 1;
+
+    if (canvas->buffered) {
+        canvas->ndamage = 0;
+        canvas_clear(canvas, canvas->area.x, canvas->area.y, canvas->area.width, canvas->area.height);
+    }
+}
+
+/*
+ * Handles an exposure. The back buffer still holds the whole frame, so a
+ * buffered canvas only has to flush the exposed area again.
+ *
+ */
+void
+canvas_expose(Canvas *canvas, int x, int y, int width, int height, int count) {
+    if (!canvas->buffered) {
+        if (count == 0)
+            canvas_damage_all(canvas);
+        return;
+    }
+    canvas_add_damage(canvas, x, y, width, height);
+}
+
+void
+canvas_render(Canvas *canvas) {
+    if (canvas->line_dirty) {
+        canvas->backend->line(canvas, canvas->line_x_left, canvas->line_y,
+                canvas->line_x_right, canvas->line_y, canvas->text_color);
+        canvas_add_damage(canvas, canvas->line_x_left, canvas->line_y,
+                canvas->line_x_right - canvas->line_x_left + 1, 1);
+        canvas->line_dirty = 0;
+    }
+
+    for (int i = 0; i < WIDGET_COUNT; i++)
+        if (canvas->widgets[i].dirty)
+            widget_draw(canvas, &canvas->widgets[i]);
+
+    if (canvas->ndamage > 0)
+        canvas->backend->flush(canvas, canvas->damage, canvas->ndamage);
+    canvas->ndamage = 0;
+}
+
+void
+canvas_layout(Canvas *canvas, const RenderRect *output) {
+    int line_gap = 20;
+    int ascent = canvas->ascent, descent = canvas->descent;
+    int height = ascent + descent;
+
+    /* define base coordinates - middle of screen */
+    int base_x = output->x + output->width / 2;
+    int base_y = output->y + output->height / 2;    /* y-position of the line */
+
+    // http://filonenko-mikhail.github.io/clx-truetype/ttf-metrics.png
+    canvas->center_x = base_x;
+    canvas->line_x_left = base_x - output->width / 8;
+    canvas->line_x_right = base_x + output->width / 8;
+    canvas->line_y = base_y;
+
+    canvas->widgets[WIDGET_USERNAME].baseline = base_y - (line_gap/2) - descent;
+    // base_y the middle of the screen. height*2 because
+    // we pass two lines: username and line of date (get left up of corner of text)
+    // line+gap*1.5: 0.5 line gap between username and line and 1 line gap between date and username
+    canvas->widgets[WIDGET_INFO].baseline = base_y - (line_gap*1.5) - height - descent;
+    canvas->widgets[WIDGET_PASSWORD].baseline = base_y + ascent + line_gap;
+    canvas->widgets[WIDGET_CAPS].baseline = base_y + (line_gap*2) + height + ascent;
+
+    canvas->backend->place(canvas, output);
+    canvas->area = *output;
+
+    canvas_damage_all(canvas);
+}
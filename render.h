@@ -0,0 +1,90 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#ifndef CSXLOCK_RENDER_H
+#define CSXLOCK_RENDER_H
+
+/* an area of the lock window, in window coordinates */
+typedef struct RenderRect {
+    int x, y;
+    int width, height;
+} RenderRect;
+
+/* everything drawn on the lockscreen except for the separator line */
+enum {
+    WIDGET_USERNAME,
+    WIDGET_INFO,        /* date, time and keyboard layout */
+    WIDGET_PASSWORD,    /* password mask or 'authentication failed' */
+    WIDGET_CAPS,        /* caps lock warning */
+    WIDGET_COUNT
+};
+
+/* retained state of one line of text */
+typedef struct Widget {
+    char text[256];
+    int len;
+    int width;          /* cached text width */
+    unsigned long color;
+    int baseline;       /* y-position of the text, fixed */
+    RenderRect box;     /* area painted by the last frame */
+    int dirty;          /* needs repainting on the next frame */
+} Widget;
+
+typedef struct Canvas Canvas;
+
+/*
+ * What a canvas draws with. Coordinates are window coordinates, colors are
+ * pixel values of the backend. A backend keeps its own state in a struct
+ * starting with the Canvas.
+ */
+typedef struct RenderBackend {
+    int (*text_width)(Canvas *canvas, const char *text, int len);
+    /* the canvas covers a new area, called before it is repainted */
+    void (*place)(Canvas *canvas, const RenderRect *area);
+    void (*clear)(Canvas *canvas, int x, int y, int width, int height);
+    void (*text)(Canvas *canvas, int x, int y, unsigned long color, const char *text, int len);
+    void (*line)(Canvas *canvas, int x1, int y1, int x2, int y2, unsigned long color);
+    /* makes the damaged areas of a buffered canvas visible */
+    void (*flush)(Canvas *canvas, const RenderRect *damage, int ndamage);
+} RenderBackend;
+
+/* the lockscreen drawn on one output */
+struct Canvas {
+    const RenderBackend *backend;
+    int buffered;       /* drawn into a back buffer, damaged areas are flushed */
+    RenderRect area;    /* the output */
+    int ascent, descent;
+    unsigned long text_color;
+    int center_x;
+    int line_x_left, line_x_right, line_y;
+    int line_dirty;
+    Widget widgets[WIDGET_COUNT];
+    RenderRect damage[WIDGET_COUNT + 1];    /* window areas to flush */
+    int ndamage;
+};
+
+/*
+ * Replaces the text of a widget. It is only marked dirty (and measured) when
+ * the text or the color actually changed.
+ */
+void widget_set(Canvas *canvas, int widget, const char *text, int len, unsigned long color);
+
+/* places the widgets in the middle of an output and prepares a full repaint */
+void canvas_layout(Canvas *canvas, const RenderRect *output);
+
+/* marks everything for repainting */
+void canvas_damage_all(Canvas *canvas);
+
+/* an area of the window was exposed, count more exposures follow */
+void canvas_expose(Canvas *canvas, int x, int y, int width, int height, int count);
+
+/* draws what changed since the previous frame, and nothing else */
+void canvas_render(Canvas *canvas);
+
+#endif /* CSXLOCK_RENDER_H */
@@ -0,0 +1,81 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+/* explicit_bzero() and MAP_ANONYMOUS */
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <unistd.h>     // sysconf()
+#include <sys/mman.h>
+
+#include "secure.h"
+
+/* blocks are aligned for any type */
+#define ALIGN 16
+
+static unsigned char *arena;
+static size_t arena_size;
+static size_t arena_used;
+
+int
+secure_init(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    arena = map;
+    arena_size = size;
+    arena_used = 0;
+
+    if (secure_lock() == -1) {
+        munmap(map, size);
+        arena = NULL;
+        return -1;
+    }
+#ifdef MADV_DONTDUMP
+    /* keep the password out of core dumps too */
+    madvise(map, size, MADV_DONTDUMP);
+#endif
+    return 0;
+}
+
+int
+secure_lock(void) {
+    return mlock(arena, arena_size);
+}
+
+void *
+secure_alloc(size_t size) {
+    size = (size + ALIGN - 1) / ALIGN * ALIGN;
+    if (!arena || size > arena_size - arena_used)
+        return NULL;
+
+    /* fresh anonymous pages are zeroed already */
+    void *block = arena + arena_used;
+    arena_used += size;
+    return block;
+}
+
+void
+secure_clear(void *buf, size_t size) {
+    explicit_bzero(buf, size);
+}
+
+void
+secure_release(void) {
+    if (!arena)
+        return;
+    explicit_bzero(arena, arena_size);
+    munlock(arena, arena_size);
+    munmap(arena, arena_size);
+    arena = NULL;
+    arena_size = arena_used = 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#ifndef CSXLOCK_SECURE_H
+#define CSXLOCK_SECURE_H
+
+#include <stddef.h>
+
+/*
+ * One region for the password and the buffers of the event loop, allocated
+ * and locked in memory once, so that nothing secret is swapped to disk or
+ * left behind on the heap. Returns -1 with errno set on failure.
+ */
+int secure_init(size_t size);
+
+/* memory locks are not inherited over fork(), the child locks again */
+int secure_lock(void);
+
+/* carves a zeroed block out of the region, NULL when it is used up */
+void *secure_alloc(size_t size);
+
+/* scrubs memory in a way the compiler can not optimize out */
+void secure_clear(void *buf, size_t size);
+
+/* scrubs, unlocks and unmaps the region */
+void secure_release(void);
+
+#endif /* CSXLOCK_SECURE_H */
@@ -0,0 +1,215 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>       // clock_gettime()
+
+#include "stats.h"
+
+/*
+ * Log-linear histogram: values below SUB_BUCKETS get a bucket each, every
+ * following power of two is split into SUB_BUCKETS linear buckets. Relative
+ * error stays below 1/SUB_BUCKETS over the whole uint64_t range.
+ */
+#define SUB_BITS      3
+#define SUB_BUCKETS   (1 << SUB_BITS)
+#define BUCKETS       (SUB_BUCKETS + (64 - SUB_BITS) * SUB_BUCKETS)
+
+typedef struct Histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min, max;
+    uint32_t buckets[BUCKETS];
+} Histogram;
+
+int stats_enabled;
+unsigned long stats_roundtrips;
+
+static FILE *stats_out;
+static uint64_t milestones[STATS_MILESTONE_COUNT];
+static Histogram histograms[STATS_HISTOGRAM_COUNT];
+
+static const char *milestone_names[STATS_MILESTONE_COUNT] = {
+    [STATS_START]         = "start",
+    [STATS_MAP]           = "map",
+    [STATS_GRAB_POINTER]  = "grab_pointer",
+    [STATS_GRAB_KEYBOARD] = "grab_keyboard",
+    [STATS_PAM_READY]     = "pam_ready",
+    [STATS_FIRST_FRAME]   = "first_frame",
+};
+
+static const char *histogram_names[STATS_HISTOGRAM_COUNT] = {
+    [STATS_KEY_TO_FLUSH]     = "key_to_flush_us",
+    [STATS_AUTH]             = "auth_us",
+    [STATS_FRAME_REQUESTS]   = "frame_requests",
+    [STATS_FRAME_ROUNDTRIPS] = "frame_roundtrips",
+    [STATS_LOCK]             = "lock_us",
+    [STATS_CAPTURE]          = "capture_us",
+    [STATS_BLUR]             = "blur_us",
+    [STATS_UPLOAD]           = "upload_us",
+    [STATS_FRAME_ALLOCS]     = "frame_allocs",
+    [STATS_SLEEP_LOCK]       = "sleep_lock_us",
+};
+
+#ifdef STATS_ALLOCS
+/*
+ * Test builds count the heap allocations by interposing glibc's allocator,
+ * the event loop is expected not to make any once it runs.
+ */
+unsigned long stats_allocs;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *
+malloc(size_t size) {
+    __sync_fetch_and_add(&stats_allocs, 1);
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size) {
+    __sync_fetch_and_add(&stats_allocs, 1);
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size) {
+    __sync_fetch_and_add(&stats_allocs, 1);
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+static int
+bucket_index(uint64_t value) {
+    if (value < SUB_BUCKETS)
+        return value;
+    int exp = 63 - __builtin_clzll(value);
+    int sub = (value >> (exp - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return SUB_BUCKETS + (exp - SUB_BITS) * SUB_BUCKETS + sub;
+}
+
+/* smallest value falling into a bucket */
+static uint64_t
+bucket_low(int index) {
+    if (index < SUB_BUCKETS)
+        return index;
+    int exp = (index - SUB_BUCKETS) / SUB_BUCKETS + SUB_BITS;
+    int sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+    return (uint64_t)(SUB_BUCKETS + sub) << (exp - SUB_BITS);
+}
+
+/* value below which the given per mille of the recorded values fall */
+static uint64_t
+percentile(const Histogram *h, unsigned int permille) {
+    uint64_t rank = (h->count * permille + 999) / 1000, seen = 0;
+
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank && h->buckets[i]) {
+            uint64_t value = i + 1 < BUCKETS ? bucket_low(i + 1) - 1 : h->max;
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * Starts collecting. Statistics are appended to path, or written to stderr
+ * when path is NULL. The file is opened right away, with whatever identity
+ * the caller has then. Returns -1 with errno set when it can not be opened.
+ *
+ */
+int
+stats_enable(const char *path) {
+    if (path && !(stats_out = fopen(path, "a")))
+        return -1;
+    if (stats_out)
+        fcntl(fileno(stats_out), F_SETFD, FD_CLOEXEC);
+    else
+        stats_out = stderr;
+    stats_enabled = 1;
+    return 0;
+}
+
+/* monotonic time in microseconds */
+uint64_t
+stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+stats_mark(StatsMilestone milestone) {
+    if (stats_enabled && !milestones[milestone])
+        milestones[milestone] = stats_now();
+}
+
+/*
+ * Adds a value to a histogram. Never allocates, safe to call from the hot
+ * path.
+ *
+ */
+void
+stats_record(StatsHistogram histogram, uint64_t value) {
+    Histogram *h = &histograms[histogram];
+
+    if (!stats_enabled)
+        return;
+    if (h->count == 0 || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->count++;
+    h->sum += value;
+    h->buckets[bucket_index(value)]++;
+}
+
+/*
+ * Writes a summary of everything recorded so far. Milestones are in
+ * milliseconds since process start.
+ *
+ */
+void
+stats_dump(void) {
+    FILE *out = stats_out;
+
+    if (!stats_enabled)
+        return;
+
+    fprintf(out, "csxlock stats at %.3f ms\n",
+            (stats_now() - milestones[STATS_START]) / 1000.0);
+    for (int i = STATS_START + 1; i < STATS_MILESTONE_COUNT; i++) {
+        if (milestones[i])
+            fprintf(out, "  %-16s %10.3f ms\n", milestone_names[i],
+                    (milestones[i] - milestones[STATS_START]) / 1000.0);
+        else
+            fprintf(out, "  %-16s %10s\n", milestone_names[i], "-");
+    }
+
+    for (int i = 0; i < STATS_HISTOGRAM_COUNT; i++) {
+        const Histogram *h = &histograms[i];
+        fprintf(out, "  %-16s count=%llu", histogram_names[i], (unsigned long long)h->count);
+        if (h->count)
+            fprintf(out, " min=%llu mean=%llu p50=%llu p90=%llu p99=%llu max=%llu",
+                    (unsigned long long)h->min,
+                    (unsigned long long)(h->sum / h->count),
+                    (unsigned long long)percentile(h, 500),
+                    (unsigned long long)percentile(h, 900),
+                    (unsigned long long)percentile(h, 990),
+                    (unsigned long long)h->max);
+        fputc('\n', out);
+    }
+
+    fflush(out);
+}
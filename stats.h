@@ -0,0 +1,61 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#ifndef CSXLOCK_STATS_H
+#define CSXLOCK_STATS_H
+
+#include <stdint.h>
+
+/* points in time recorded once per run */
+typedef enum StatsMilestone {
+    STATS_START,            /* process start */
+    STATS_MAP,              /* window mapped */
+    STATS_GRAB_POINTER,     /* pointer grab succeeded */
+    STATS_GRAB_KEYBOARD,    /* keyboard grab succeeded */
+    STATS_PAM_READY,        /* authentication helper finished pam_start() */
+    STATS_FIRST_FRAME,      /* first frame flushed */
+    STATS_MILESTONE_COUNT
+} StatsMilestone;
+
+/* distributions recorded for every occurrence */
+typedef enum StatsHistogram {
+    STATS_KEY_TO_FLUSH,     /* KeyPress receipt to the flush of its frame, us */
+    STATS_AUTH,             /* password sent to verdict received, us */
+    STATS_FRAME_REQUESTS,   /* X requests issued per frame */
+    STATS_FRAME_ROUNDTRIPS, /* X round trips made per frame */
+    STATS_LOCK,             /* lock command to both grabs held (daemon), us */
+    STATS_CAPTURE,          /* screenshot of one output (--blur), us */
+    STATS_BLUR,             /* blur of one output, us */
+    STATS_UPLOAD,           /* blurred output into the background pixmap, us */
+    STATS_FRAME_ALLOCS,     /* heap allocations per frame (STATS_ALLOCS builds) */
+    STATS_SLEEP_LOCK,       /* PrepareForSleep to the lock painted (--logind), us */
+    STATS_HISTOGRAM_COUNT
+} StatsHistogram;
+
+/* non-zero once stats_enable() was called, checked before recording */
+extern int stats_enabled;
+
+/* round trips counted by STATS_ROUNDTRIP() since the last frame */
+extern unsigned long stats_roundtrips;
+
+/* marks a synchronous X call made from the event loop */
+#define STATS_ROUNDTRIP(n) (stats_roundtrips += (n))
+
+#ifdef STATS_ALLOCS
+/* malloc(), calloc() and realloc() calls since the last frame */
+extern unsigned long stats_allocs;
+#endif
+
+int stats_enable(const char *path);
+uint64_t stats_now(void);
+void stats_mark(StatsMilestone milestone);
+void stats_record(StatsHistogram histogram, uint64_t value);
+void stats_dump(void);
+
+#endif /* CSXLOCK_STATS_H */
@@ -0,0 +1,334 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>     // PATH_MAX
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>     // struct timeval
+#include <sys/un.h>     // struct sockaddr_un
+
+#include "status.h"
+
+typedef struct Provider Provider;
+
+struct Provider {
+    const char *name;
+    int period;             /* ms between samples */
+    int (*init)(Provider *provider, const char *arg);
+    void (*sample)(Provider *provider, char *text, size_t size);
+    char path[2][PATH_MAX]; /* what sample reads, found by init */
+    /* the text is written into the buffer seq does not point at, then seq
+     * is incremented. The next text goes into the buffer seq pointed at
+     * before, which a reader may still be copying: a copy only counts when
+     * seq did not change at all meanwhile */
+    char text[2][STATUS_TEXT];
+    unsigned int seq;
+};
+
+static Provider providers[STATUS_MAX_PROVIDERS];
+static int nproviders;
+static int event_fd = -1;
+
+/*
+ * Reads a small file with plain system calls, the trailing newline is cut
+ * off. Returns the length, -1 when it can not be read.
+ *
+ */
+static int
+read_file(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0)
+        return -1;
+    while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == ' '))
+        n--;
+    buf[n] = '\0';
+    return n;
+}
+
+/*
+ * The first battery in /sys/class/power_supply, its capacity and whether
+ * it is being charged.
+ *
+ */
+static int
+battery_init(Provider *provider, const char *arg) {
+    const char *base = "/sys/class/power_supply";
+    char path[PATH_MAX], type[16];
+    struct dirent *entry;
+    DIR *dir;
+    int found = -1;
+
+    (void)arg;
+    if ((dir = opendir(base)) == NULL)
+        return -1;
+    while (found == -1 && (entry = readdir(dir))) {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/type", base, entry->d_name);
+        if (read_file(path, type, sizeof(type)) == -1 || strcmp(type, "Battery") != 0)
+            continue;
+        snprintf(provider->path[0], sizeof(provider->path[0]), "%s/%s/capacity", base, entry->d_name);
+        snprintf(provider->path[1], sizeof(provider->path[1]), "%s/%s/status", base, entry->d_name);
+        found = 0;
+    }
+    closedir(dir);
+    return found;
+}
+
+static void
+battery_sample(Provider *provider, char *text, size_t size) {
+    char capacity[8], state[16];
+
+    if (read_file(provider->path[0], capacity, sizeof(capacity)) <= 0)
+        return;
+    if (read_file(provider->path[1], state, sizeof(state)) == -1)
+        state[0] = '\0';
+    snprintf(text, size, "bat %s%%%s", capacity, strcmp(state, "Charging") == 0 ? " +" : "");
+}
+
+static const char net_base[] = "/sys/class/net";
+
+static int
+network_init(Provider *provider, const char *arg) {
+    (void)provider;
+    (void)arg;
+    return access(net_base, R_OK);
+}
+
+/*
+ * The first interface which is up, except loopback. Interfaces come and
+ * go, so the directory is read every time.
+ *
+ */
+static void
+network_sample(Provider *provider, char *text, size_t size) {
+    char path[PATH_MAX], state[16];
+    struct dirent *entry;
+    DIR *dir;
+
+    (void)provider;
+    if ((dir = opendir(net_base)) == NULL)
+        return;
+    snprintf(text, size, "offline");
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.' || strcmp(entry->d_name, "lo") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/operstate", net_base, entry->d_name);
+        if (read_file(path, state, sizeof(state)) == -1 || strcmp(state, "up") != 0)
+            continue;
+        snprintf(text, size, "net %s", entry->d_name);
+        break;
+    }
+    closedir(dir);
+}
+
+/*
+ * A notification daemon (or a script) listening on a socket, answering
+ * every connection with the number of pending notifications.
+ *
+ */
+static int
+notify_init(Provider *provider, const char *arg) {
+    size_t size = sizeof(((struct sockaddr_un *)NULL)->sun_path);
+    int n;
+
+    if (arg)
+        n = snprintf(provider->path[0], size, "%s", arg);
+    else if (getenv("XDG_RUNTIME_DIR"))
+        n = snprintf(provider->path[0], size, "%s/csxlock-notify.socket", getenv("XDG_RUNTIME_DIR"));
+    else
+        n = snprintf(provider->path[0], size, "/tmp/csxlock-notify-%d.socket", (int)getuid());
+    return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+/*
+ * Only a socket owned by the user is connected to: csxlock may run as root
+ * and the path is named by the user.
+ *
+ */
+static void
+notify_sample(Provider *provider, char *text, size_t size) {
+    struct sockaddr_un addr;
+    struct timeval timeout = { 1, 0 };
+    struct stat st;
+    char buf[16];
+    ssize_t n;
+    int fd;
+
+    if (lstat(provider->path[0], &st) == -1 || !S_ISSOCK(st.st_mode) || st.st_uid != getuid())
+        return;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, provider->path[0], sizeof(addr.sun_path) - 1);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            (n = recv(fd, buf, sizeof(buf) - 1, 0)) <= 0) {
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    buf[n] = '\0';
+    long count = strtol(buf, NULL, 10);
+    if (count == 1)
+        snprintf(text, size, "1 notification");
+    else if (count > 1)
+        snprintf(text, size, "%ld notifications", count);
+}
+
+static const Provider kinds[] = {
+    { .name = "battery", .period = 30000, .init = battery_init, .sample = battery_sample },
+    { .name = "network", .period = 5000,  .init = network_init, .sample = network_sample },
+    { .name = "notify",  .period = 10000, .init = notify_init,  .sample = notify_sample },
+};
+
+/*
+ * Samples forever. A changed text is published and the eventfd bumped, an
+ * unchanged one costs the main loop nothing.
+ *
+ */
+static void *
+provider_run(void *arg) {
+    Provider *provider = arg;
+    char text[STATUS_TEXT];
+    uint64_t one = 1;
+
+    for (;;) {
+        text[0] = '\0';
+        provider->sample(provider, text, sizeof(text));
+
+        unsigned int seq = __atomic_load_n(&provider->seq, __ATOMIC_RELAXED);
+        if (strcmp(text, provider->text[seq & 1]) != 0) {
+            /* the last increment is seen before this buffer changes */
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            memcpy(provider->text[(seq + 1) & 1], text, sizeof(text));
+            __atomic_store_n(&provider->seq, seq + 1, __ATOMIC_RELEASE);
+            if (write(event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+                break;
+        }
+        poll(NULL, 0, provider->period);
+    }
+    return NULL;
+}
+
+int
+status_start(const char *list) {
+    char name[128];     /* notify=SOCKET */
+    pthread_attr_t attr;
+    sigset_t all, saved;
+
+    while (*list && nproviders < STATUS_MAX_PROVIDERS) {
+        size_t n = strcspn(list, ",");
+        snprintf(name, sizeof(name), "%.*s", (int)n, list);
+        list += n + (list[n] == ',');
+
+        char *arg = strchr(name, '=');
+        if (arg)
+            *arg++ = '\0';
+        size_t k;
+        for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+            if (strcmp(name, kinds[k].name) == 0)
+                break;
+        if (k == sizeof(kinds) / sizeof(kinds[0])) {
+            fprintf(stderr, "Warning: unknown status provider %s.\n", name);
+            continue;
+        }
+
+        Provider *provider = &providers[nproviders];
+        *provider = kinds[k];
+        if (provider->init(provider, arg) == -1) {
+            fprintf(stderr, "Warning: nothing for the %s status provider to show.\n", name);
+            continue;
+        }
+        nproviders++;
+    }
+    if (nproviders == 0)
+        return -1;
+
+    if ((event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        nproviders = 0;
+        return -1;
+    }
+
+    /* the threads never take signals, the main loop relies on poll() being
+     * interrupted by them */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < nproviders; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, provider_run, &providers[i]) != 0)
+            fprintf(stderr, "Warning: can not start the %s status provider.\n", providers[i].name);
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return event_fd;
+}
+
+void
+status_ack(void) {
+    uint64_t count;
+    if (read(event_fd, &count, sizeof(count)) == -1)
+        return;
+}
+
+/*
+ * Copies the current texts. A provider which published during the copy is
+ * read again.
+ *
+ */
+int
+status_read(char *buf, size_t size) {
+    size_t len = 0;
+
+    buf[0] = '\0';
+    for (int i = 0; i < nproviders; i++) {
+        Provider *provider = &providers[i];
+        char text[STATUS_TEXT];
+        unsigned int seq, again = __atomic_load_n(&provider->seq, __ATOMIC_ACQUIRE);
+
+        do {
+            seq = again;
+            memcpy(text, provider->text[seq & 1], sizeof(text));
+            /* the copy is done before seq is looked at again */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            again = __atomic_load_n(&provider->seq, __ATOMIC_RELAXED);
+        } while (again != seq);
+        text[sizeof(text) - 1] = '\0';
+
+        if (text[0] == '\0')
+            continue;
+        int n = snprintf(buf + len, size - len, "%s%s", len ? " | " : "", text);
+        if (n < 0 || (size_t)n >= size - len)
+            break;
+        len += n;
+    }
+    buf[len] = '\0';
+    return len;
+}
@@ -0,0 +1,39 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#ifndef CSXLOCK_STATUS_H
+#define CSXLOCK_STATUS_H
+
+#include <stddef.h>
+
+/*
+ * Status providers for the info line. Every provider samples on its own
+ * cadence in a thread of its own and publishes a short text into a double
+ * buffered slot, which the renderer copies without taking a lock. A slow or
+ * hung provider only keeps showing its last text.
+ */
+
+/* providers at once, and the length of the text of one */
+#define STATUS_MAX_PROVIDERS 4
+#define STATUS_TEXT 48
+
+/*
+ * Starts the providers of a comma separated list: battery, network and
+ * notify[=SOCKET]. Unknown names are reported and skipped. Returns an
+ * eventfd which is readable when a text changed, -1 when nothing runs.
+ */
+int status_start(const char *list);
+
+/* empties the eventfd after it was readable */
+void status_ack(void);
+
+/* the texts of every provider joined with " | ", returns the length */
+int status_read(char *buf, size_t size);
+
+#endif /* CSXLOCK_STATUS_H */
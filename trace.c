@@ -0,0 +1,163 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>       // clock_gettime()
+#include <unistd.h>
+
+#include "trace.h"
+
+#ifdef USE_TRACE
+
+/* events kept, a power of two, older ones are overwritten */
+#define TRACE_EVENTS 16384
+
+typedef struct TraceEvent {
+    const char *name;   /* NULL while being written */
+    uint64_t ts;        /* us */
+    uint64_t dur;       /* us, UINT64_MAX for an instant */
+    int64_t arg;
+} TraceEvent;
+
+int trace_enabled;
+
+static int trace_fd = -1;
+static TraceEvent events[TRACE_EVENTS];
+static unsigned long head;      /* events ever recorded */
+
+uint64_t
+trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Claims a slot without a lock. The slot is published by its name last, a
+ * dump skips one still being written.
+ *
+ */
+static void
+record(const char *name, uint64_t ts, uint64_t dur, int64_t arg) {
+    TraceEvent *e = &events[__sync_fetch_and_add(&head, 1) & (TRACE_EVENTS - 1)];
+
+    __atomic_store_n(&e->name, NULL, __ATOMIC_RELAXED);
+    e->ts = ts;
+    e->dur = dur;
+    e->arg = arg;
+    __atomic_store_n(&e->name, name, __ATOMIC_RELEASE);
+}
+
+void
+trace_span(const char *name, uint64_t start, int64_t arg) {
+    uint64_t now = trace_now();
+    record(name, start, now - start, arg);
+}
+
+void
+trace_instant(const char *name, int64_t arg) {
+    record(name, trace_now(), UINT64_MAX, arg);
+}
+
+int
+trace_enable(const char *path) {
+    if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+        return -1;
+    trace_enabled = 1;
+    return 0;
+}
+
+void
+trace_disable(void) {
+    trace_enabled = 0;
+    if (trace_fd != -1)
+        close(trace_fd);
+    trace_fd = -1;
+}
+
+/* writes all of buf, gives up on errors */
+static void
+write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(trace_fd, buf, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Runs from the event loop on SIGUSR2, see signals_run(), and from die().
+ * Only uses write() and formatting into a buffer on the stack, so a dump
+ * still works when csxlock dies of a failed allocation.
+ *
+ */
+void
+trace_dump(void) {
+    if (trace_fd == -1)
+        return;
+
+    int saved = errno;
+    unsigned long end = head;
+    unsigned long start = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+    int pid = getpid();
+    char buf[256];
+    int n;
+
+    if (ftruncate(trace_fd, 0) == 0)
+        lseek(trace_fd, 0, SEEK_SET);
+    write_all("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", 40);
+
+    const char *sep = "";
+    for (unsigned long i = start; i < end; i++) {
+        const TraceEvent *e = &events[i & (TRACE_EVENTS - 1)];
+        const char *name = __atomic_load_n(&e->name, __ATOMIC_ACQUIRE);
+        if (!name)
+            continue;
+
+        if (e->dur == UINT64_MAX)
+            n = snprintf(buf, sizeof(buf),
+                    "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"p\",\"ts\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%lld}}",
+                    sep, name, (unsigned long long)e->ts, pid, pid, (long long)e->arg);
+        else
+            n = snprintf(buf, sizeof(buf),
+                    "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%lld}}",
+                    sep, name, (unsigned long long)e->ts, (unsigned long long)e->dur, pid, pid, (long long)e->arg);
+        if (n > 0 && n < (int)sizeof(buf))
+            write_all(buf, n);
+        sep = ",\n";
+    }
+
+    write_all("\n]}\n", 4);
+    errno = saved;
+}
+
+#else
+
+int
+trace_enable(const char *path) {
+    (void)path;
+    errno = ENOSYS;
+    return -1;
+}
+
+void
+trace_disable(void) {
+}
+
+void
+trace_dump(void) {
+}
+
+#endif
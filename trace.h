@@ -0,0 +1,62 @@
+/*
+ * MIT/X Consortium License
+ *
+ * © 2020 Paweł Szynkiewicz <pszynk  at  gmail  dot  com>
+ *
+ * See LICENSE file for copyright and license details.
+ *
+ */
+
+#ifndef CSXLOCK_TRACE_H
+#define CSXLOCK_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Flight recorder, built with USE_TRACE. Spans and instants go into a ring
+ * buffer of fixed size, which is written out as Chrome trace_event JSON (for
+ * Perfetto or chrome://tracing) on request and on abnormal exit.
+ *
+ * Events are named by string literals and carry one integer, nothing typed
+ * by the user can end up in a trace. While tracing is off every trace point
+ * costs one branch.
+ */
+
+#ifdef USE_TRACE
+
+/* non-zero once trace_enable() succeeded, checked before recording */
+extern int trace_enabled;
+
+uint64_t trace_now(void);
+void trace_span(const char *name, uint64_t start, int64_t arg);
+void trace_instant(const char *name, int64_t arg);
+
+/* start of a span, 0 while tracing is off */
+#define TRACE_START() \
+    (__builtin_expect(trace_enabled, 0) ? trace_now() : 0)
+
+/* a span from TRACE_START() until now, name must be a string literal */
+#define TRACE_SPAN(name, start, arg) \
+    do { if (__builtin_expect(trace_enabled, 0)) trace_span("" name, (start), (arg)); } while (0)
+
+#define TRACE_INSTANT(name, arg) \
+    do { if (__builtin_expect(trace_enabled, 0)) trace_instant("" name, (arg)); } while (0)
+
+#else
+
+#define TRACE_START() ((uint64_t)0)
+#define TRACE_SPAN(name, start, arg) ((void)(start))
+#define TRACE_INSTANT(name, arg) ((void)0)
+
+#endif
+
+/* returns -1 with errno set when the file can not be opened for writing */
+int trace_enable(const char *path);
+
+/* no more recording or dumping, as in the authentication helper */
+void trace_disable(void);
+
+/* rewrites the file with the events still in the buffer */
+void trace_dump(void);
+
+#endif /* CSXLOCK_TRACE_H */